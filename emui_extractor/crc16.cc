@@ -0,0 +1,52 @@
+#include "crc16.h"
+
+#include <string.h>
+
+namespace {
+
+const uint16_t kPoly = 0x8408;  // 0x1021 reflected
+
+struct Crc16Tables {
+  uint16_t t[8][256];
+
+  Crc16Tables() {
+    for (int i = 0; i < 256; ++i) {
+      uint16_t crc = i;
+      for (int j = 0; j < 8; ++j) {
+        crc = (crc & 1) ? (crc >> 1) ^ kPoly : crc >> 1;
+      }
+      t[0][i] = crc;
+    }
+    // t[k][i] is the CRC of byte i followed by k zero bytes.
+    for (int k = 1; k < 8; ++k) {
+      for (int i = 0; i < 256; ++i) {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+const Crc16Tables kTables;
+
+}  // namespace
+
+uint16_t Crc16(const uint8_t *data, size_t len) {
+  const uint16_t(*t)[256] = kTables.t;
+  uint16_t crc = 0xffff;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, data, sizeof(v));
+    v ^= crc;
+    crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^
+          t[4][(v >> 24) & 0xff] ^ t[3][(v >> 32) & 0xff] ^
+          t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+    data += 8;
+    len -= 8;
+  }
+#endif
+  while (len--) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+  }
+  return crc ^ 0xffff;
+}
@@ -0,0 +1,12 @@
+#ifndef EMUI_EXTRACTOR_CRC16_H_
+#define EMUI_EXTRACTOR_CRC16_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-16/X-25 (reflected 0x1021, init and xorout 0xffff), the checksum of
+// UPDATE.APP headers and of every block in their data_checksum_ tables.
+// Table driven, 8 bytes per step.
+uint16_t Crc16(const uint8_t *data, size_t len);
+
+#endif  // EMUI_EXTRACTOR_CRC16_H_
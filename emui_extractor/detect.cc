@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "detect.h"
+
+using namespace std;
+
+// Some images carry a vendor block before the partition data.
+static const size_t kVendorPrefixLen = 4096;
+
+static bool HasMagic(const uint8_t *p, size_t len, size_t off,
+                     const void *magic, size_t magic_len) {
+  return len >= off + magic_len && memcmp(p + off, magic, magic_len) == 0;
+}
+
+static uint32_t Le32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Returns the format |p| starts with, empty if it isn't recognized.
+static string Identify(const uint8_t *p, size_t len) {
+  static const uint8_t kSparse[] = {0x3a, 0xff, 0x26, 0xed};
+  static const uint8_t kElf[] = {0x7f, 'E', 'L', 'F'};
+  static const uint8_t kGzip[] = {0x1f, 0x8b};
+  static const uint8_t kLz4[] = {0x04, 0x22, 0x4d, 0x18};
+  static const uint8_t kLz4Legacy[] = {0x02, 0x21, 0x4c, 0x18};
+  static const uint8_t kExt4[] = {0x53, 0xef};
+  static const uint8_t kErofs[] = {0xe2, 0xe1, 0xf5, 0xe0};
+  char buf[32];
+
+  if (HasMagic(p, len, 0, kSparse, sizeof(kSparse))) {
+    return "sparse";
+  }
+  // The header version follows the kernel, ramdisk and second stage
+  // sizes and addresses in boot images, the page size in vendor_boot.
+  if (HasMagic(p, len, 0, "ANDROID!", 8)) {
+    if (len < 44) {
+      return "boot";
+    }
+    snprintf(buf, sizeof(buf), "boot v%u", Le32(p + 40));
+    return buf;
+  }
+  if (HasMagic(p, len, 0, "VNDRBOOT", 8)) {
+    if (len < 12) {
+      return "vendor_boot";
+    }
+    snprintf(buf, sizeof(buf), "vendor_boot v%u", Le32(p + 8));
+    return buf;
+  }
+  if (HasMagic(p, len, 0, "AVB0", 4)) {
+    return "vbmeta";
+  }
+  if (HasMagic(p, len, 0, kElf, sizeof(kElf)) && len > 4) {
+    return p[4] == 2 ? "elf64" : "elf32";
+  }
+  if (HasMagic(p, len, 0, kGzip, sizeof(kGzip))) {
+    return "gzip";
+  }
+  if (HasMagic(p, len, 0, kLz4, sizeof(kLz4))) {
+    return "lz4";
+  }
+  if (HasMagic(p, len, 0, kLz4Legacy, sizeof(kLz4Legacy))) {
+    return "lz4 legacy";
+  }
+  // Both keep their superblock 1024 bytes in.
+  if (HasMagic(p, len, 1024 + 0x38, kExt4, sizeof(kExt4))) {
+    return "ext4";
+  }
+  if (HasMagic(p, len, 1024, kErofs, sizeof(kErofs))) {
+    return "erofs";
+  }
+  return "";
+}
+
+Format DetectFormat(const uint8_t *head, size_t len) {
+  Format format;
+  format.name = Identify(head, len);
+  if (format.name.empty() && len > kVendorPrefixLen) {
+    format.name = Identify(head + kVendorPrefixLen, len - kVendorPrefixLen);
+    if (!format.name.empty()) {
+      format.prefix = kVendorPrefixLen;
+    }
+  }
+  if (format.name.empty()) {
+    format.name = "data";
+  }
+  return format;
+}
@@ -0,0 +1,23 @@
+#ifndef EMUI_EXTRACTOR_DETECT_H_
+#define EMUI_EXTRACTOR_DETECT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// What the data of an image looks like.
+struct Format {
+  // "sparse", "ext4", "erofs", "boot v2", "vendor_boot v3", "vbmeta",
+  // "elf32", "elf64", "gzip", "lz4", "lz4 legacy", or "data" if unknown.
+  std::string name;
+  // Length of the vendor block before the recognized data, 0 if none.
+  size_t prefix = 0;
+};
+
+// How much of the start of an image DetectFormat() looks at.
+static const size_t kDetectLen = 8192;
+
+// Classifies an image by the first |len| bytes of its data.
+Format DetectFormat(const uint8_t *head, size_t len);
+
+#endif  // EMUI_EXTRACTOR_DETECT_H_
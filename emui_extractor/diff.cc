@@ -0,0 +1,202 @@
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "diff.h"
+#include "hash.h"
+#include "worker_pool.h"
+
+using namespace std;
+
+// Data without CRC tables is hashed in granules of this size, which is also
+// the resolution of the ranges reported for it.
+static const size_t kHashGranule = 64 * 1024;
+// Each task hashes this much, with reads of kHashReadSize.
+static const size_t kHashChunk = 64 * 1024 * 1024;
+static const size_t kHashReadSize = 8 * 1024 * 1024;
+
+namespace {
+
+// An image present in both packages.
+struct DiffPair {
+  const Image *a;
+  const Image *b;
+  ImageDiff *diff;
+  vector<uint64_t> hash_a;
+  vector<uint64_t> hash_b;
+};
+
+}  // namespace
+
+vector<string> ImageNames(const RoImageFile &pkg) {
+  map<string, unsigned> seen;
+  vector<string> names;
+  for (const auto &img : pkg.GetAllImages()) {
+    const auto &type = img->GetHdr()->type_;
+    string name(reinterpret_cast<const char *>(type),
+                strnlen(reinterpret_cast<const char *>(type), sizeof(type)));
+    name += ".img";
+    unsigned n = seen[name]++;
+    if (n) {
+      name += "#" + to_string(n);
+    }
+    names.push_back(name);
+  }
+  return names;
+}
+
+static void AddRange(ImageDiff *diff, uint64_t begin, uint64_t end) {
+  if (!diff->ranges.empty() && diff->ranges.back().second == begin) {
+    diff->ranges.back().second = end;
+  } else {
+    diff->ranges.emplace_back(begin, end);
+  }
+}
+
+static bool SameHeader(const Image::ImageHdr &a, const Image::ImageHdr &b) {
+  return a.sequence_ == b.sequence_ &&
+         memcmp(a.hw_id_, b.hw_id_, sizeof(a.hw_id_)) == 0 &&
+         memcmp(a.date_, b.date_, sizeof(a.date_)) == 0 &&
+         memcmp(a.time_, b.time_, sizeof(a.time_)) == 0;
+}
+
+static void DiffCrcTables(const Image &a, const Image &b, ImageDiff *diff) {
+  uint64_t len_a = a.GetHdr()->data_len_;
+  uint64_t len_b = b.GetHdr()->data_len_;
+  uint64_t common = len_a < len_b ? len_a : len_b;
+  const uint8_t *ta = a.GetHdr()->data_checksum_;
+  const uint8_t *tb = b.GetHdr()->data_checksum_;
+  for (uint64_t off = 0; off < common; off += Image::kCrcBlockSize) {
+    uint64_t end = off + Image::kCrcBlockSize;
+    size_t i = off / Image::kCrcBlockSize * sizeof(uint16_t);
+    // A block cut short in only one of them can't be compared.
+    bool partial = end > common && len_a != len_b;
+    if (partial || memcmp(ta + i, tb + i, sizeof(uint16_t)) != 0) {
+      AddRange(diff, off, end < common ? end : common);
+    }
+  }
+  if (len_a != len_b) {
+    AddRange(diff, common, len_a > len_b ? len_a : len_b);
+  }
+}
+
+static bool HashRange(const Image &img, uint64_t off, uint64_t len,
+                      vector<uint64_t> *hashes) {
+  unique_ptr<uint8_t[]> buf(new uint8_t[kHashReadSize]);
+  while (len) {
+    size_t n = len < kHashReadSize ? len : kHashReadSize;
+    if (!img.Read(off, buf.get(), n)) {
+      return false;
+    }
+    for (size_t done = 0; done < n; done += kHashGranule) {
+      size_t g = n - done < kHashGranule ? n - done : kHashGranule;
+      (*hashes)[(off + done) / kHashGranule] =
+          Hash64(buf.get() + done, g, kHash64Seed);
+    }
+    off += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Hashes the first |len| bytes of |img|.
+static void SubmitHash(WorkerPool *pool, const Image *img, uint64_t len,
+                       vector<uint64_t> *hashes, atomic<bool> *ok) {
+  hashes->resize((len + kHashGranule - 1) / kHashGranule);
+  for (uint64_t off = 0; off < len; off += kHashChunk) {
+    uint64_t n = len - off < kHashChunk ? len - off : kHashChunk;
+    pool->Submit([img, off, n, hashes, ok] {
+      if (!HashRange(*img, off, n, hashes)) {
+        *ok = false;
+      }
+    });
+  }
+}
+
+static void DiffHashes(const DiffPair &p) {
+  uint64_t len_a = p.a->GetHdr()->data_len_;
+  uint64_t len_b = p.b->GetHdr()->data_len_;
+  uint64_t common = len_a < len_b ? len_a : len_b;
+  for (uint64_t off = 0; off < common; off += kHashGranule) {
+    size_t i = off / kHashGranule;
+    if (p.hash_a[i] != p.hash_b[i]) {
+      uint64_t end = off + kHashGranule;
+      AddRange(p.diff, off, end < common ? end : common);
+    }
+  }
+  if (len_a != len_b) {
+    AddRange(p.diff, common, len_a > len_b ? len_a : len_b);
+  }
+}
+
+Error DiffPackages(const RoImageFile &a, const RoImageFile &b,
+                   unsigned threads, vector<ImageDiff> *diffs) {
+  vector<string> names_a = ImageNames(a);
+  vector<string> names_b = ImageNames(b);
+  map<string, const Image *> by_name;
+  for (size_t i = 0; i < names_a.size(); ++i) {
+    by_name[names_a[i]] = a.GetAllImages()[i].get();
+  }
+
+  diffs->clear();
+  diffs->reserve(names_a.size() + names_b.size());
+  vector<DiffPair> to_hash;
+  for (size_t i = 0; i < names_b.size(); ++i) {
+    const Image *img_b = b.GetAllImages()[i].get();
+    diffs->emplace_back();
+    ImageDiff *diff = &diffs->back();
+    diff->name = names_b[i];
+    auto it = by_name.find(names_b[i]);
+    if (it == by_name.end()) {
+      diff->kind = ImageDiff::kAdded;
+      continue;
+    }
+    const Image *img_a = it->second;
+    by_name.erase(it);
+    diff->header_changed = !SameHeader(*img_a->GetHdr(), *img_b->GetHdr());
+    // Equal tables mean equal data, short of a CRC16 collision per block.
+    if (img_a->HasCrcTable() && img_b->HasCrcTable()) {
+      DiffCrcTables(*img_a, *img_b, diff);
+    } else {
+      to_hash.push_back({img_a, img_b, diff, {}, {}});
+    }
+  }
+  for (size_t i = 0; i < names_a.size(); ++i) {
+    if (by_name.count(names_a[i])) {
+      diffs->emplace_back();
+      diffs->back().kind = ImageDiff::kRemoved;
+      diffs->back().name = names_a[i];
+    }
+  }
+
+  atomic<bool> ok(true);
+  {
+    WorkerPool pool(threads);
+    for (auto &p : to_hash) {
+      // Past the shorter one, everything counts as changed anyway.
+      uint64_t len_a = p.a->GetHdr()->data_len_;
+      uint64_t len_b = p.b->GetHdr()->data_len_;
+      uint64_t common = len_a < len_b ? len_a : len_b;
+      SubmitHash(&pool, p.a, common, &p.hash_a, &ok);
+      SubmitHash(&pool, p.b, common, &p.hash_b, &ok);
+    }
+    pool.Wait();
+  }
+  if (!ok) {
+    return Error(Error::kRead, "error read " + a.file_name() + " or " +
+                                   b.file_name());
+  }
+  for (const auto &p : to_hash) {
+    DiffHashes(p);
+  }
+
+  for (auto &diff : *diffs) {
+    if (diff.kind == ImageDiff::kSame &&
+        (diff.header_changed || !diff.ranges.empty())) {
+      diff.kind = ImageDiff::kChanged;
+    }
+  }
+  return Error();
+}
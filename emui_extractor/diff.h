@@ -0,0 +1,35 @@
+#ifndef EMUI_EXTRACTOR_DIFF_H_
+#define EMUI_EXTRACTOR_DIFF_H_
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "error.h"
+#include "image.h"
+
+// How one image differs between two packages.
+struct ImageDiff {
+  enum Kind { kSame, kChanged, kAdded, kRemoved };
+
+  Kind kind = kSame;
+  // TYPE.img, with "#N" appended to the Nth repeat of a type.
+  std::string name;
+  // Sequence, device, date or time differ.
+  bool header_changed = false;
+  // Changed [begin, end) byte ranges, as offsets in the image data.
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+};
+
+// Names the images of |pkg| in package order as TYPE.img, with "#N"
+// appended to the Nth repeat of a type so that repeats pair up in order
+// and none hides another.
+std::vector<std::string> ImageNames(const RoImageFile &pkg);
+
+// Compares the images of |a| and |b| by name. The CRC tables in the headers
+// decide where they exist; the data is only read, in parallel on |threads|
+// workers, for images without them.
+Error DiffPackages(const RoImageFile &a, const RoImageFile &b,
+                   unsigned threads, std::vector<ImageDiff> *diffs);
+
+#endif  // EMUI_EXTRACTOR_DIFF_H_
@@ -0,0 +1,225 @@
+// Times list, dump and verify through libemui, with the package out of and
+// in the page cache, and counts the system calls they make.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "image.h"
+#include "worker_pool.h"
+
+using namespace std;
+
+namespace {
+
+struct Counters {
+  double time = 0;
+  uint64_t syscalls = 0;
+  uint64_t major_faults = 0;
+};
+
+}  // namespace
+
+static const char *usage =
+    "Usage: emui_bench [-j jobs] [-o dir] UPDATE.APP\n"
+    "  -j, --jobs         - number of threads (default: CPU count)\n"
+    "  -o, --out DIR      - directory for the dumped images (default: .)\n";
+
+// Read and write system calls of the whole process so far, from
+// /proc/self/io.
+static uint64_t Syscalls() {
+  FILE *fp = fopen("/proc/self/io", "r");
+  if (!fp) {
+    return 0;
+  }
+  uint64_t total = 0;
+  char key[32];
+  unsigned long long value;
+  while (fscanf(fp, "%31s %llu", key, &value) == 2) {
+    if (strcmp(key, "syscr:") == 0 || strcmp(key, "syscw:") == 0) {
+      total += value;
+    }
+  }
+  fclose(fp);
+  return total;
+}
+
+static Counters Now() {
+  Counters c;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  c.time = ts.tv_sec + ts.tv_nsec / 1e9;
+  c.syscalls = Syscalls();
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  c.major_faults = ru.ru_majflt;
+  return c;
+}
+
+// Drops the package from the page cache. Only clean pages can go, which
+// all of a package's pages are.
+static void DropCache(const string &file_name) {
+  // For "archive.zip!entry", the archive itself.
+  string path = file_name;
+  if (access(path.c_str(), F_OK) == -1) {
+    path = path.substr(0, path.rfind('!'));
+  }
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Runs |step| with stdout silenced and prints a line of results. |bytes|
+// is the image data the step goes through, 0 if that doesn't apply.
+static bool Run(const char *name, bool cold, const string &file_name,
+                uint64_t bytes, const function<bool()> &step) {
+  if (cold) {
+    DropCache(file_name);
+  }
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  Counters begin = Now();
+  bool ok = step();
+  Counters end = Now();
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  double secs = end.time - begin.time;
+  uint64_t syscalls = end.syscalls - begin.syscalls;
+  fprintf(stdout, "%-10s %-4s %9.4f", name, cold ? "cold" : "warm", secs);
+  if (bytes) {
+    double gb = bytes / (1024.0 * 1024 * 1024);
+    fprintf(stdout, " %10.1f %10llu %12.0f", bytes / (1024.0 * 1024) / secs,
+            static_cast<unsigned long long>(syscalls), syscalls / gb);
+  } else {
+    fprintf(stdout, " %10s %10llu %12s", "-",
+            static_cast<unsigned long long>(syscalls), "-");
+  }
+  uint64_t faults = end.major_faults - begin.major_faults;
+  fprintf(stdout, " %8llu%s\n", static_cast<unsigned long long>(faults),
+          ok ? "" : "  FAILED");
+  return ok;
+}
+
+static void RemoveOutputs(
+    const vector<pair<shared_ptr<Image>, string>> &jobs) {
+  for (const auto &job : jobs) {
+    unlink(job.second.c_str());
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned jobs = WorkerPool::DefaultThreads();
+  string out_dir = ".";
+  struct option options[] = {
+      {"jobs", required_argument, NULL, 'j'},
+      {"out", required_argument, NULL, 'o'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "j:o:", options, NULL)) != -1) {
+    switch (c) {
+      case 'j': {
+        char *end;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end || n <= 0 || n > INT_MAX) {
+          fprintf(stderr, "bad number of jobs: %s\n%s", optarg, usage);
+          return -1;
+        }
+        jobs = n;
+        break;
+      }
+      case 'o':
+        out_dir = optarg;
+        break;
+      default:
+        fprintf(stderr, "%s", usage);
+        return -1;
+    }
+  }
+  if (optind + 1 != argc) {
+    fprintf(stderr, "%s", usage);
+    return -1;
+  }
+  string file_name = argv[optind];
+
+  Error err;
+  unique_ptr<RoImageFile> pkg = RoImageFile::Open(file_name, &err, false);
+  if (!pkg) {
+    fprintf(stderr, "Failed to load: %s\n", err.message().c_str());
+    return -1;
+  }
+  vector<pair<shared_ptr<Image>, string>> all;
+  vector<pair<shared_ptr<Image>, string>> largest;
+  uint64_t total = 0;
+  for (const auto &img : pkg->GetAllImages()) {
+    string type(reinterpret_cast<const char *>(img->GetHdr()->type_));
+    all.emplace_back(img, out_dir + "/bench-" + type + ".img");
+    total += img->GetHdr()->data_len_;
+    if (largest.empty() ||
+        img->GetHdr()->data_len_ > largest[0].first->GetHdr()->data_len_) {
+      largest.assign(1, all.back());
+    }
+  }
+  uint64_t largest_len = largest[0].first->GetHdr()->data_len_;
+
+  fprintf(stdout, "%s: %zu images, %.1f MiB, %u threads\n", file_name.c_str(),
+          all.size(), total / (1024.0 * 1024), jobs);
+  fprintf(stdout, "%-10s %-4s %9s %10s %10s %12s %8s\n", "step", "page",
+          "seconds", "MB/s", "syscalls", "syscalls/GB", "majflt");
+
+  // Have the header index written before it is timed.
+  RoImageFile::Open(file_name, &err, true);
+
+  bool ok = true;
+  for (bool cold : {true, false}) {
+    ok &= Run("list", cold, file_name, 0, [&] {
+      Error e;
+      return RoImageFile::Open(file_name, &e, false) != nullptr;
+    });
+  }
+  for (bool cold : {true, false}) {
+    ok &= Run("list-index", cold, file_name, 0, [&] {
+      Error e;
+      return RoImageFile::Open(file_name, &e, true) != nullptr;
+    });
+  }
+  for (bool cold : {true, false}) {
+    ok &= Run("dump-one", cold, file_name, largest_len, [&] {
+      return pkg->DumpImages(largest, jobs);
+    });
+    RemoveOutputs(largest);
+  }
+  for (bool cold : {true, false}) {
+    ok &= Run("dump-all", cold, file_name, total, [&] {
+      return pkg->DumpImages(all, jobs);
+    });
+    RemoveOutputs(all);
+  }
+  for (bool cold : {true, false}) {
+    ok &= Run("verify", cold, file_name, total, [&] {
+      return pkg->VerifyImages(pkg->GetAllImages(), jobs);
+    });
+  }
+  return ok ? 0 : 1;
+}
@@ -1,9 +1,20 @@
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
+#include "detect.h"
+#include "diff.h"
 #include "image.h"
+#include "pack.h"
+#include "worker_pool.h"
 
 using namespace std;
 
@@ -30,16 +41,81 @@ static string convert_size_to_str(uint32_t size) {
   return string(buf);
 }
 
-static int list_images(const char *in_file) {
-  RoImageFile *image_file = RoImageFile::Create(in_file);
-  if (!image_file->Load()) {
-    fprintf(stderr, "Failed to load\n");
+static unique_ptr<RoImageFile> load_package(const char *in_file,
+                                            bool use_index) {
+  Error err;
+  unique_ptr<RoImageFile> image_file =
+      RoImageFile::Open(in_file, &err, use_index);
+  if (!image_file) {
+    fprintf(stderr, "Failed to load: %s\n", err.message().c_str());
+  }
+  return image_file;
+}
+
+// Classifies all images, reading their first bytes concurrently.
+static vector<Format> detect_formats(
+    const vector<shared_ptr<Image>> &images, unsigned jobs) {
+  vector<Format> formats(images.size());
+  WorkerPool pool(min<size_t>(jobs, images.size()));
+  for (size_t i = 0; i < images.size(); ++i) {
+    const Image *img = images[i].get();
+    Format *format = &formats[i];
+    pool.Submit([img, format] {
+      size_t len = img->GetHdr()->data_len_;
+      len = len < kDetectLen ? len : kDetectLen;
+      uint8_t head[kDetectLen];
+      if (img->Read(0, head, len)) {
+        *format = DetectFormat(head, len);
+      } else {
+        format->name = "unreadable";
+      }
+    });
+  }
+  pool.Wait();
+  return formats;
+}
+
+static string json_string(const char *s) {
+  string out = "\"";
+  for (; *s; ++s) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+static int list_images(const char *in_file, bool use_index, bool detect,
+                       bool json, unsigned jobs) {
+  unique_ptr<RoImageFile> image_file = load_package(in_file, use_index);
+  if (!image_file) {
     return -1;
   }
 
   auto images = image_file->GetAllImages();
+  vector<Format> formats;
+  if (detect) {
+    formats = detect_formats(images, jobs);
+  }
+  // Files as diff and emui_fuse name them, TYPE.img#N for repeats.
+  vector<string> names = ImageNames(*image_file);
+  vector<string> devices;
   unsigned size_len = 0;
   unsigned type_len = 0;
+  unsigned file_len = 0;
+  for (const auto &name : names) {
+    if (name.size() > file_len) {
+      file_len = name.size();
+    }
+  }
   for (const auto &img : images) {
     string size_str = convert_size_to_str(img->GetHdr()->data_len_);
     if (size_str.size() > size_len) {
@@ -49,69 +125,325 @@ static int list_images(const char *in_file) {
     if (len > type_len) {
       type_len = len;
     }
-  }
-  string line(8 + 1 + type_len + 4 + 1 + size_len + 1 + type_len + 1 + 8, '=');
-  fprintf(stdout, "%s\n", line.c_str());
-  fprintf(stdout, "%8s %*s.img %*s %*s %8s\n", "Sequence", type_len, "File",
-          size_len, "Size", type_len, "Type", "Device");
-  fprintf(stdout, "%s\n", line.c_str());
-  for (const auto &img : images) {
-    string size_str = convert_size_to_str(img->GetHdr()->data_len_);
     int i = sizeof(img->GetHdr()->hw_id_) - 1;
     while (i >= 0 && img->GetHdr()->hw_id_[i] == 0xff) {
       --i;
     }
     ++i;
-    string device(reinterpret_cast<const char *>(&img->GetHdr()->hw_id_[0]), i);
-    fprintf(stdout, "%08x %*s.img %*s %*s %8s\n", img->GetHdr()->sequence_,
-            type_len, img->GetHdr()->type_, size_len, size_str.c_str(), type_len,
-            img->GetHdr()->type_, device.c_str());
+    devices.emplace_back(
+        reinterpret_cast<const char *>(&img->GetHdr()->hw_id_[0]), i);
   }
+
+  if (json) {
+    fprintf(stdout, "[");
+    for (size_t i = 0; i < images.size(); ++i) {
+      auto hdr = images[i]->GetHdr();
+      string type(reinterpret_cast<const char *>(hdr->type_));
+      fprintf(stdout,
+              "%s\n  {\"sequence\": \"%08x\", \"file\": %s, \"type\": %s, "
+              "\"size\": %u, \"device\": %s",
+              i ? "," : "", hdr->sequence_,
+              json_string(names[i].c_str()).c_str(),
+              json_string(type.c_str()).c_str(), hdr->data_len_,
+              json_string(devices[i].c_str()).c_str());
+      if (detect) {
+        fprintf(stdout, ", \"format\": \"%s\", \"prefix\": %zu",
+                formats[i].name.c_str(), formats[i].prefix);
+      }
+      fprintf(stdout, "}");
+    }
+    fprintf(stdout, "\n]\n");
+    return 0;
+  }
+
+  unsigned format_len = detect ? 6 : 0;
+  vector<string> format_strs;
+  for (const auto &format : formats) {
+    format_strs.push_back(format.prefix ? "4K prefix+" + format.name
+                                        : format.name);
+    if (format_strs.back().size() > format_len) {
+      format_len = format_strs.back().size();
+    }
+  }
+  string line(8 + 1 + file_len + 1 + size_len + 1 + type_len + 1 + 8 +
+                  (detect ? 1 + format_len : 0),
+              '=');
   fprintf(stdout, "%s\n", line.c_str());
+  fprintf(stdout, "%8s %*s %*s %*s %8s", "Sequence", file_len, "File",
+          size_len, "Size", type_len, "Type", "Device");
+  if (detect) {
+    fprintf(stdout, " Format");
+  }
+  fprintf(stdout, "\n%s\n", line.c_str());
+  for (size_t i = 0; i < images.size(); ++i) {
+    const auto &img = images[i];
+    string size_str = convert_size_to_str(img->GetHdr()->data_len_);
+    fprintf(stdout, "%08x %*s %*s %*s %8s", img->GetHdr()->sequence_,
+            file_len, names[i].c_str(), size_len, size_str.c_str(), type_len,
+            img->GetHdr()->type_, devices[i].c_str());
+    if (detect) {
+      fprintf(stdout, " %s", format_strs[i].c_str());
+    }
+    fprintf(stdout, "\n");
+  }
+  fprintf(stdout, "%s\n", line.c_str());
+  return 0;
 }
 
-static int dump_image(const char *in_file, const char *img_name,
-                      const char *out_file) {
-  RoImageFile *image_file = RoImageFile::Create(in_file);
-  if (!image_file->Load()) {
-    fprintf(stderr, "Failed to load\n");
+// Dumps the image named |patterns[0]| to |out_file|, or, without
+// |out_file|, every image matching one of the glob |patterns| to TYPE.img.
+static int dump_image(const char *in_file, const vector<const char *> &patterns,
+                      const char *out_file, unsigned jobs, bool use_index,
+                      bool verify, bool raw) {
+  unique_ptr<RoImageFile> image_file = load_package(in_file, use_index);
+  if (!image_file) {
     return -1;
   }
 
+  vector<pair<shared_ptr<Image>, string>> targets;
+  vector<bool> used(patterns.size());
   auto images = image_file->GetAllImages();
   for (const auto &img : images) {
     string type(reinterpret_cast<const char *>(img->GetHdr()->type_));
     type += ".img";
 
-    if (out_file == string("all")) {
-      img->Dump(type);
+    if (out_file) {
+      if (type == patterns[0]) {
+        targets.emplace_back(img, out_file);
+        used[0] = true;
+        break;
+      }
       continue;
     }
 
-    if (type != img_name) {
+    bool match = false;
+    for (size_t i = 0; i < patterns.size(); ++i) {
+      if (fnmatch(patterns[i], type.c_str(), 0) == 0) {
+        used[i] = true;
+        match = true;
+      }
+    }
+    if (!match) {
       continue;
     }
-    img->Dump(out_file);
-    return 0;
+    // A later image of the same name wins, as it would on disk.
+    for (auto it = targets.begin(); it != targets.end(); ++it) {
+      if (it->second == type) {
+        targets.erase(it);
+        break;
+      }
+    }
+    targets.emplace_back(img, type);
+  }
+  for (size_t i = 0; i < patterns.size(); ++i) {
+    if (!used[i] && strcmp(patterns[i], "*") != 0) {
+      fprintf(stderr, "err find %s\n", patterns[i]);
+      return -1;
+    }
   }
-  if (out_file != string("all")) {
+  return image_file->DumpImages(targets, jobs, verify, raw) ? 0 : -1;
+}
+
+static int verify_images(const char *in_file, const char *img_name,
+                         unsigned jobs, bool use_index) {
+  unique_ptr<RoImageFile> image_file = load_package(in_file, use_index);
+  if (!image_file) {
+    return -1;
+  }
+
+  vector<shared_ptr<Image>> targets;
+  for (const auto &img : image_file->GetAllImages()) {
+    string type(reinterpret_cast<const char *>(img->GetHdr()->type_));
+    if (!img_name || type + ".img" == img_name) {
+      targets.push_back(img);
+    }
+  }
+  if (targets.empty() && img_name) {
     fprintf(stderr, "err find %s\n", img_name);
     return -1;
   }
+  return image_file->VerifyImages(targets, jobs) ? 0 : -1;
+}
+
+static int export_tar(const char *in_file, char **patterns, int count,
+                      bool use_index) {
+  if (isatty(STDOUT_FILENO)) {
+    fprintf(stderr, "refusing to write a tar archive to a terminal\n");
+    return -1;
+  }
+  unique_ptr<RoImageFile> image_file = load_package(in_file, use_index);
+  if (!image_file) {
+    return -1;
+  }
+
+  vector<shared_ptr<Image>> targets;
+  for (const auto &img : image_file->GetAllImages()) {
+    string type(reinterpret_cast<const char *>(img->GetHdr()->type_));
+    type += ".img";
+    bool match = count == 0;
+    for (int i = 0; i < count && !match; ++i) {
+      match = fnmatch(patterns[i], type.c_str(), 0) == 0;
+    }
+    if (match) {
+      targets.push_back(img);
+    }
+  }
+  return image_file->ExportTar(targets, STDOUT_FILENO) ? 0 : -1;
+}
+
+static int pack_images(const char *out_file, const char *list_file,
+                       unsigned jobs) {
+  vector<PackEntry> entries;
+  Error err = ReadPackList(list_file, &entries);
+  if (err.ok()) {
+    err = PackImages(entries, out_file, jobs);
+  }
+  if (!err.ok()) {
+    fprintf(stderr, "Failed to pack: %s\n", err.message().c_str());
+    return -1;
+  }
   return 0;
 }
 
+static int diff_packages(const char *old_file, const char *new_file,
+                         unsigned jobs, bool use_index) {
+  unique_ptr<RoImageFile> old_pkg = load_package(old_file, use_index);
+  unique_ptr<RoImageFile> new_pkg = load_package(new_file, use_index);
+  if (!old_pkg || !new_pkg) {
+    return -1;
+  }
+  vector<ImageDiff> diffs;
+  Error err = DiffPackages(*old_pkg, *new_pkg, jobs, &diffs);
+  if (!err.ok()) {
+    fprintf(stderr, "Failed to diff: %s\n", err.message().c_str());
+    return -1;
+  }
+
+  unsigned same = 0;
+  for (const auto &diff : diffs) {
+    switch (diff.kind) {
+      case ImageDiff::kSame:
+        ++same;
+        break;
+      case ImageDiff::kAdded:
+        fprintf(stdout, "A %s\n", diff.name.c_str());
+        break;
+      case ImageDiff::kRemoved:
+        fprintf(stdout, "D %s\n", diff.name.c_str());
+        break;
+      case ImageDiff::kChanged:
+        fprintf(stdout, "M %s%s\n", diff.name.c_str(),
+                diff.ranges.empty() ? " (header only)" : "");
+        for (const auto &range : diff.ranges) {
+          fprintf(stdout, "    0x%010llx-0x%010llx\n",
+                  static_cast<unsigned long long>(range.first),
+                  static_cast<unsigned long long>(range.second));
+        }
+        break;
+    }
+  }
+  fprintf(stdout, "%u unchanged, %zu changed\n", same, diffs.size() - same);
+  return same == diffs.size() ? 0 : 1;
+}
+
 static const char *usage =
-    "Usage: emui_extractor UPDATE.APP cmd\n"
+    "Usage: emui_extractor [-j jobs] [-n] [-V] [-r] UPDATE.APP cmd\n"
     "  cmd:\n"
     "    list              - list all images in the UPDATE.APP\n"
-    "    dump image output - dump one of image in the UPDATE.APP\n";
+    "      -d, --detect    - also show the format of each image's data\n"
+    "      --json          - print the list as JSON\n"
+    "    dump image output - dump one of image in the UPDATE.APP\n"
+    "    dump all          - dump all images to the current directory\n"
+    "    extract pattern...\n"
+    "                      - dump the images matching the glob patterns to the\n"
+    "                        current directory, reading the package in order\n"
+    "    verify [image]    - check the CRCs of all images, or of one image\n"
+    "    export-tar [pattern...]\n"
+    "                      - write images matching the glob patterns (default:\n"
+    "                        all) as a tar archive to stdout\n"
+    "    diff NEW.APP      - list images added, removed or changed in NEW.APP,\n"
+    "                        with the changed byte ranges\n"
+    "    pack list         - build the UPDATE.APP from the images in list, one\n"
+    "                        per line: FILE TYPE SEQUENCE HW_ID [DATE [TIME]]\n"
+    "  -j, --jobs         - number of dump threads (default: CPU count)\n"
+    "  -n, --no-index     - don't use or write the UPDATE.APP.idx header index\n"
+    "  -V, --verify       - check CRCs while dumping\n"
+    "  -r, --raw          - dump partition contents: drop the 4096-byte vendor\n"
+    "                       header and expand sparse images\n";
 
 int main(int argc, char **argv) {
+  unsigned jobs = WorkerPool::DefaultThreads();
+  bool use_index = true;
+  bool verify = false;
+  bool raw = false;
+  bool detect = false;
+  bool json = false;
+  struct option options[] = {
+      {"jobs", required_argument, NULL, 'j'},
+      {"no-index", no_argument, NULL, 'n'},
+      {"verify", no_argument, NULL, 'V'},
+      {"raw", no_argument, NULL, 'r'},
+      {"detect", no_argument, NULL, 'd'},
+      {"json", no_argument, NULL, 'J'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "j:nVrd", options, NULL)) != -1) {
+    switch (c) {
+      case 'j': {
+        char *end;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end || n <= 0 || n > INT_MAX) {
+          fprintf(stderr, "bad number of jobs: %s\n%s", optarg, usage);
+          return -1;
+        }
+        jobs = n;
+        break;
+      }
+      case 'n':
+        use_index = false;
+        break;
+      case 'V':
+        verify = true;
+        break;
+      case 'r':
+        raw = true;
+        break;
+      case 'd':
+        detect = true;
+        break;
+      case 'J':
+        json = true;
+        break;
+      default:
+        fprintf(stderr, "%s", usage);
+        return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if (argc == 3 && strcmp(argv[2], "list") == 0) {
-    return list_images(argv[1]);
+    return list_images(argv[1], use_index, detect, json, jobs);
+  } else if ((argc == 4 || argc == 5) && strcmp(argv[2], "dump") == 0 &&
+             (strcmp(argv[3], "all") == 0 ||
+              strcmp(argv[argc - 1], "all") == 0)) {
+    return dump_image(argv[1], {"*"}, nullptr, jobs, use_index, verify, raw);
   } else if (argc == 5 && strcmp(argv[2], "dump") == 0) {
-    return dump_image(argv[1], argv[3], argv[4]);
+    return dump_image(argv[1], {argv[3]}, argv[4], jobs, use_index, verify,
+                      raw);
+  } else if (argc >= 4 && strcmp(argv[2], "extract") == 0) {
+    return dump_image(argv[1], vector<const char *>(argv + 3, argv + argc),
+                      nullptr, jobs, use_index, verify, raw);
+  } else if (argc == 4 && strcmp(argv[2], "diff") == 0) {
+    return diff_packages(argv[1], argv[3], jobs, use_index);
+  } else if (argc == 4 && strcmp(argv[2], "pack") == 0) {
+    return pack_images(argv[1], argv[3], jobs);
+  } else if (argc >= 3 && strcmp(argv[2], "export-tar") == 0) {
+    return export_tar(argv[1], argv + 3, argc - 3, use_index);
+  } else if ((argc == 3 || argc == 4) && strcmp(argv[2], "verify") == 0) {
+    return verify_images(argv[1], argc == 4 ? argv[3] : nullptr, jobs,
+                         use_index);
   } else {
     fprintf(stderr, "%s", usage);
     return -1;
@@ -0,0 +1,190 @@
+// Mounts an UPDATE.APP read-only, with each image as a file of the root
+// directory. Reads go straight to the package, nothing is extracted.
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "diff.h"
+#include "image.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+  const char *package = nullptr;
+  int raw = 0;
+  int no_index = 0;
+  int show_help = 0;
+};
+
+}  // namespace
+
+#define OPTION(t, p) {t, offsetof(Options, p), 1}
+static const struct fuse_opt option_spec[] = {
+    OPTION("-r", raw),
+    OPTION("--raw", raw),
+    OPTION("-n", no_index),
+    OPTION("--no-index", no_index),
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    FUSE_OPT_END,
+};
+
+static unique_ptr<RoImageFile> package;
+// Keyed by "/TYPE.img".
+static map<string, unique_ptr<Image::View>> files;
+static struct stat package_st;
+
+static const char *usage =
+    "Usage: emui_fuse [-r] [-n] UPDATE.APP MOUNTPOINT [fuse options]\n"
+    "  -r, --raw          - show partition contents: drop the 4096-byte vendor\n"
+    "                       header and expand sparse images\n"
+    "  -n, --no-index     - don't use or write the UPDATE.APP.idx header index\n"
+    "\n";
+
+static void *emui_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  (void)conn;
+  // The package doesn't change under us, so let the kernel cache pages and
+  // attributes.
+  cfg->kernel_cache = 1;
+  cfg->entry_timeout = cfg->attr_timeout = 3600;
+  return nullptr;
+}
+
+static int emui_getattr(const char *path, struct stat *st,
+                        struct fuse_file_info *fi) {
+  (void)fi;
+  memset(st, 0, sizeof(*st));
+  st->st_uid = package_st.st_uid;
+  st->st_gid = package_st.st_gid;
+  st->st_atim = package_st.st_atim;
+  st->st_mtim = package_st.st_mtim;
+  st->st_ctim = package_st.st_ctim;
+  if (strcmp(path, "/") == 0) {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    return 0;
+  }
+  auto it = files.find(path);
+  if (it == files.end()) {
+    return -ENOENT;
+  }
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_size = it->second->size();
+  st->st_blocks = (st->st_size + 511) / 512;
+  return 0;
+}
+
+static int emui_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                        off_t offset, struct fuse_file_info *fi,
+                        enum fuse_readdir_flags flags) {
+  (void)offset;
+  (void)fi;
+  (void)flags;
+  if (strcmp(path, "/") != 0) {
+    return -ENOENT;
+  }
+  filler(buf, ".", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+  filler(buf, "..", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+  for (const auto &f : files) {
+    filler(buf, f.first.c_str() + 1, nullptr, 0,
+           static_cast<fuse_fill_dir_flags>(0));
+  }
+  return 0;
+}
+
+static int emui_open(const char *path, struct fuse_file_info *fi) {
+  auto it = files.find(path);
+  if (it == files.end()) {
+    return -ENOENT;
+  }
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(it->second.get());
+  fi->keep_cache = 1;
+  return 0;
+}
+
+static int emui_read(const char *path, char *buf, size_t size, off_t off,
+                     struct fuse_file_info *fi) {
+  (void)path;
+  const Image::View *view = reinterpret_cast<const Image::View *>(fi->fh);
+  ssize_t count = view->Read(off, reinterpret_cast<uint8_t *>(buf), size);
+  return count < 0 ? -EIO : count;
+}
+
+static int emui_opt_proc(void *data, const char *arg, int key,
+                         struct fuse_args *outargs) {
+  (void)outargs;
+  Options *opts = static_cast<Options *>(data);
+  // The first non-option is the package, the rest go to fuse.
+  if (key == FUSE_OPT_KEY_NONOPT && !opts->package) {
+    opts->package = strdup(arg);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  Options opts;
+  if (fuse_opt_parse(&args, &opts, option_spec, emui_opt_proc) == -1) {
+    return 1;
+  }
+  if (opts.show_help || !opts.package) {
+    fprintf(stderr, "%s", usage);
+    if (opts.show_help) {
+      // Let fuse print its own options too.
+      fuse_opt_add_arg(&args, "--help");
+      args.argv[0][0] = '\0';
+    } else {
+      return 1;
+    }
+  } else {
+    Error err;
+    package = RoImageFile::Open(opts.package, &err, !opts.no_index);
+    if (!package) {
+      fprintf(stderr, "Failed to load: %s\n", err.message().c_str());
+      return 1;
+    }
+    // For "archive.zip!entry", the archive itself.
+    string file = package->file_name();
+    if (stat(file.substr(0, file.find('!')).c_str(), &package_st) == -1) {
+      memset(&package_st, 0, sizeof(package_st));
+    }
+    // Repeated types show up as TYPE.img#1, ..., as `diff` and `list` name
+    // them.
+    vector<string> names = ImageNames(*package);
+    const auto &images = package->GetAllImages();
+    for (size_t i = 0; i < images.size(); ++i) {
+      unique_ptr<Image::View> view(new Image::View);
+      if (!view->Open(images[i], opts.raw)) {
+        return 1;
+      }
+      files["/" + names[i]] = move(view);
+    }
+  }
+
+  struct fuse_operations ops = {};
+  ops.init = emui_init;
+  ops.getattr = emui_getattr;
+  ops.readdir = emui_readdir;
+  ops.open = emui_open;
+  ops.read = emui_read;
+  int ret = fuse_main(args.argc, args.argv, &ops, nullptr);
+  fuse_opt_free_args(&args);
+  return ret;
+}
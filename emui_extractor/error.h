@@ -0,0 +1,39 @@
+#ifndef EMUI_EXTRACTOR_ERROR_H_
+#define EMUI_EXTRACTOR_ERROR_H_
+
+#include <string.h>
+#include <string>
+
+// Outcome of a package operation. A default constructed Error is success.
+class Error {
+ public:
+  enum Code {
+    kOk = 0,
+    kOpen,     // The package can't be opened or stat'ed.
+    kRead,     // I/O error while reading the package.
+    kFormat,   // The package isn't a valid UPDATE.APP.
+    kWrite,    // I/O error while writing output.
+  };
+
+  Error() = default;
+  Error(Code code, const std::string &message, int sys_errno = 0)
+      : code_(code), sys_errno_(sys_errno), message_(message) {
+    if (sys_errno) {
+      message_ += ": ";
+      message_ += strerror(sys_errno);
+    }
+  }
+
+  bool ok() const { return code_ == kOk; }
+  Code code() const { return code_; }
+  // errno of the failed call, 0 if the error didn't come from the system.
+  int sys_errno() const { return sys_errno_; }
+  const std::string &message() const { return message_; }
+
+ private:
+  Code code_ = kOk;
+  int sys_errno_ = 0;
+  std::string message_;
+};
+
+#endif  // EMUI_EXTRACTOR_ERROR_H_
@@ -0,0 +1,143 @@
+#include "file_range.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+#include "image.h"
+#include "zip.h"
+
+using namespace std;
+
+// Parses "OFF[+LEN]". |len| is left alone without "+LEN".
+static bool ParseOffLen(const string &s, uint64_t *off, uint64_t *len) {
+  const char *p = s.c_str();
+  char *end;
+  if (!*p || *p == '+' || *p == '-') {
+    return false;
+  }
+  errno = 0;
+  *off = strtoull(p, &end, 0);
+  if (*end == '+' && end[1] && end[1] != '-') {
+    *len = strtoull(end + 1, &end, 0);
+  }
+  return !*end && errno == 0;
+}
+
+// Finds entry |name| of the zip archive that is all of |outer|.
+static Error ResolveZipEntry(const FileRange &outer, const string &name,
+                             FileRange *range) {
+  int fd = open(outer.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return Error(Error::kOpen, "error open " + outer.path, errno);
+  }
+  ZipEntry entry;
+  Error err = FindZipEntry(fd, outer.size, name, &entry);
+  close(fd);
+  if (!err.ok()) {
+    return err;
+  }
+  if (!entry.stored) {
+    return Error(Error::kOpen, name + " is deflated, not stored");
+  }
+  range->path = outer.path;
+  range->offset = entry.offset;
+  range->size = entry.size;
+  return Error();
+}
+
+// Finds image |name| of the UPDATE.APP |outer_spec|, which resolved to
+// |outer|.
+static Error ResolveImage(const string &outer_spec, const FileRange &outer,
+                          const string &name, FileRange *range) {
+  Error err;
+  // Only the headers are needed; leave no index next to the firmware.
+  unique_ptr<RoImageFile> pkg = RoImageFile::Open(outer_spec, &err, false);
+  if (!pkg) {
+    return err;
+  }
+  shared_ptr<Image> found;
+  for (const auto &img : pkg->GetAllImages()) {
+    string type(reinterpret_cast<const char *>(img->GetHdr()->type_));
+    // A later image of the same name wins, as it would on disk.
+    if (name == type || name == type + ".img") {
+      found = img;
+    }
+  }
+  if (!found) {
+    return Error(Error::kOpen, name + " not found in " + outer_spec);
+  }
+  off_t off;
+  uint64_t len;
+  if (!found->Extent(&off, &len)) {
+    return Error(Error::kFormat, outer_spec + " isn't stored as is");
+  }
+  range->path = outer.path;
+  range->offset = off;
+  range->size = len;
+  return Error();
+}
+
+Error ResolveRange(const string &spec, FileRange *range) {
+  struct stat st;
+  if (stat(spec.c_str(), &st) == 0) {
+    if (!S_ISREG(st.st_mode)) {
+      return Error(Error::kOpen, spec + " isn't a regular file");
+    }
+    range->path = spec;
+    range->offset = 0;
+    range->size = st.st_size;
+    return Error();
+  }
+  if (errno != ENOENT && errno != ENOTDIR) {
+    return Error(Error::kOpen, "error stat " + spec, errno);
+  }
+
+  // The last '@' or '!' applies to everything before it.
+  size_t sep = spec.find_last_of("@!");
+  if (sep == string::npos || sep == 0 || sep + 1 == spec.size()) {
+    return Error(Error::kOpen, "error stat " + spec, ENOENT);
+  }
+  string outer_spec = spec.substr(0, sep);
+  string rest = spec.substr(sep + 1);
+  FileRange outer;
+  Error err = ResolveRange(outer_spec, &outer);
+  if (!err.ok()) {
+    return err;
+  }
+
+  if (spec[sep] == '@') {
+    uint64_t off;
+    uint64_t len = UINT64_MAX;
+    if (!ParseOffLen(rest, &off, &len)) {
+      return Error(Error::kOpen, "bad range " + rest);
+    }
+    if (len == UINT64_MAX) {
+      len = off <= outer.size ? outer.size - off : 0;
+    }
+    if (off > outer.size || len > outer.size - off) {
+      return Error(Error::kOpen, spec + " is past the end of " + outer_spec);
+    }
+    range->path = outer.path;
+    range->offset = outer.offset + off;
+    range->size = len;
+    return Error();
+  }
+
+  // Only a whole file can be a zip archive, as FindZipEntry() reads it
+  // from the start. Archives that turn out broken are tried as packages.
+  if (outer.offset == 0) {
+    err = ResolveZipEntry(outer, rest, range);
+    if (err.ok() || err.code() != Error::kFormat) {
+      return err;
+    }
+  }
+  Error pkg_err = ResolveImage(outer_spec, outer, rest, range);
+  if (pkg_err.code() == Error::kFormat && !err.ok()) {
+    return Error(Error::kFormat,
+                 outer_spec + ": not an UPDATE.APP, " + err.message());
+  }
+  return pkg_err;
+}
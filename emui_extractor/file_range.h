@@ -0,0 +1,27 @@
+#ifndef EMUI_EXTRACTOR_FILE_RANGE_H_
+#define EMUI_EXTRACTOR_FILE_RANGE_H_
+
+#include <stdint.h>
+#include <string>
+#include "error.h"
+
+// Where a file lies as is in a file on disk: |size| bytes at |offset| of
+// |path|. Readers map or pread the range in place, nothing is extracted.
+struct FileRange {
+  std::string path;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+// Resolves |spec| to the range holding it. |spec| is one of
+//   FILE               the whole file
+//   SPEC@OFF[+LEN]     LEN bytes at OFF of SPEC, the rest of it by default;
+//                      OFF and LEN may be hex with 0x
+//   ZIP!ENTRY          an entry of a zip archive, which must be stored
+//   UPDATE.APP!TYPE    the data of the last image of that type, TYPE.img
+//                      also matching, of a package given as any SPEC
+// so specs nest, as in "factory.zip!UPDATE.APP!ABL.img". Deflated entries
+// aren't in the archive as is and fail.
+Error ResolveRange(const std::string &spec, FileRange *range);
+
+#endif  // EMUI_EXTRACTOR_FILE_RANGE_H_
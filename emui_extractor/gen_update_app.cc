@@ -0,0 +1,210 @@
+// Writes a synthetic UPDATE.APP of pseudo-random images, for benchmarks
+// and tests that can't use vendor packages.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "crc16.h"
+#include "image.h"
+#include "pack.h"
+
+using namespace std;
+
+static const size_t kWriteBufSize = 8 * 1024 * 1024;
+
+static const char *usage =
+    "Usage: gen_update_app [options] OUT.APP\n"
+    "  -n, --count N      - number of images (default: 8)\n"
+    "  -s, --sizes LIST   - comma separated image sizes with optional K/M/G\n"
+    "                       suffix, used in turn (default: 64M)\n"
+    "  -a, --align N      - start images on N byte boundaries, a multiple of\n"
+    "                       4 (default: 4)\n"
+    "  -c, --no-crc       - leave out the data_checksum_ tables\n"
+    "  --seed N           - seed of the image data (default: 1)\n";
+
+static bool ParseSize(const string &s, uint64_t *size) {
+  char *end;
+  uint64_t v = strtoull(s.c_str(), &end, 0);
+  switch (*end) {
+    case 'G':
+      v *= 1024;
+      // fall through
+    case 'M':
+      v *= 1024;
+      // fall through
+    case 'K':
+      v *= 1024;
+      ++end;
+      break;
+  }
+  if (end == s.c_str() || *end || v > UINT32_MAX) {
+    return false;
+  }
+  *size = v;
+  return true;
+}
+
+static bool ParseSizes(const char *arg, vector<uint64_t> *sizes) {
+  string list(arg);
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t comma = list.find(',', pos);
+    if (comma == string::npos) {
+      comma = list.size();
+    }
+    uint64_t size;
+    if (!ParseSize(list.substr(pos, comma - pos), &size)) {
+      return false;
+    }
+    sizes->push_back(size);
+    pos = comma + 1;
+  }
+  return !sizes->empty();
+}
+
+// xorshift64*, plenty for data that only has to defeat compression and
+// dedup.
+static uint64_t Next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static bool PwriteAll(int fd, const uint8_t *buf, size_t len, off_t off) {
+  while (len) {
+    ssize_t count = pwrite(fd, buf, len, off);
+    if (count <= 0) {
+      return false;
+    }
+    buf += count;
+    off += count;
+    len -= count;
+  }
+  return true;
+}
+
+// Writes image |index| of |size| bytes at |pos|, and returns its end.
+static off_t WriteImage(int fd, off_t pos, unsigned index, uint64_t size,
+                        bool crc, uint64_t seed) {
+  PackEntry entry;
+  entry.type = "IMG" + to_string(index);
+  entry.sequence = 0xfe000000 + index;
+  entry.hw_id = "SYNTH";
+  entry.date = "2020.01.01";
+  entry.time = "12.00.00";
+  vector<uint8_t> hdr_buf;
+  InitImageHdr(entry, size, crc, &hdr_buf);
+  auto *hdr = reinterpret_cast<Image::ImageHdr *>(hdr_buf.data());
+
+  // The data goes first so the CRC table can be filled on the way.
+  uint64_t state = (seed + index) * 0x9e3779b97f4a7c15ULL | 1;
+  unique_ptr<uint64_t[]> buf(new uint64_t[kWriteBufSize / sizeof(uint64_t)]);
+  uint8_t *p = reinterpret_cast<uint8_t *>(buf.get());
+  off_t data_off = pos + hdr_buf.size();
+  for (uint64_t off = 0; off < size; off += kWriteBufSize) {
+    size_t n = size - off < kWriteBufSize ? size - off : kWriteBufSize;
+    for (size_t i = 0; i < (n + 7) / 8; ++i) {
+      buf[i] = Next(&state);
+    }
+    for (size_t done = 0; crc && done < n; done += Image::kCrcBlockSize) {
+      size_t len = n - done < Image::kCrcBlockSize ? n - done
+                                                   : Image::kCrcBlockSize;
+      uint16_t sum = Crc16(p + done, len);
+      size_t block = (off + done) / Image::kCrcBlockSize;
+      memcpy(&hdr->data_checksum_[block * sizeof(sum)], &sum, sizeof(sum));
+    }
+    if (!PwriteAll(fd, p, n, data_off + off)) {
+      return -1;
+    }
+  }
+  hdr->hdr_checksum_ = Crc16(hdr_buf.data(), hdr_buf.size());
+  if (!PwriteAll(fd, hdr_buf.data(), hdr_buf.size(), pos)) {
+    return -1;
+  }
+  return data_off + size;
+}
+
+int main(int argc, char **argv) {
+  unsigned count = 8;
+  vector<uint64_t> sizes;
+  uint64_t align = 4;
+  bool crc = true;
+  uint64_t seed = 1;
+  struct option options[] = {
+      {"count", required_argument, NULL, 'n'},
+      {"sizes", required_argument, NULL, 's'},
+      {"align", required_argument, NULL, 'a'},
+      {"no-crc", no_argument, NULL, 'c'},
+      {"seed", required_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "n:s:a:c", options, NULL)) != -1) {
+    switch (c) {
+      case 'n':
+        count = atoi(optarg);
+        break;
+      case 's':
+        if (!ParseSizes(optarg, &sizes)) {
+          fprintf(stderr, "bad sizes: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'a':
+        align = strtoull(optarg, nullptr, 0);
+        break;
+      case 'c':
+        crc = false;
+        break;
+      case 'S':
+        seed = strtoull(optarg, nullptr, 0);
+        break;
+      default:
+        fprintf(stderr, "%s", usage);
+        return -1;
+    }
+  }
+  if (optind + 1 != argc || count == 0 || align == 0 || align % 4) {
+    fprintf(stderr, "%s", usage);
+    return -1;
+  }
+  if (sizes.empty()) {
+    sizes.push_back(64 * 1024 * 1024);
+  }
+  const char *out_fn = argv[optind];
+
+  int fd = open(out_fn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if (fd == -1) {
+    fprintf(stderr, "error open %s: %s\n", out_fn, strerror(errno));
+    return -1;
+  }
+  // The prefix and the padding are holes of the file, read as zeros.
+  off_t pos = kPackPrefixLen;
+  off_t end = pos;
+  for (unsigned i = 0; i < count; ++i) {
+    end = WriteImage(fd, pos, i, sizes[i % sizes.size()], crc, seed);
+    if (end == -1) {
+      fprintf(stderr, "error write %s: %s\n", out_fn, strerror(errno));
+      close(fd);
+      unlink(out_fn);
+      return -1;
+    }
+    pos = (end + align - 1) / align * align;
+  }
+  if (ftruncate(fd, RoImageFile::Align(end)) == -1 || close(fd) == -1) {
+    fprintf(stderr, "error write %s: %s\n", out_fn, strerror(errno));
+    unlink(out_fn);
+    return -1;
+  }
+  return 0;
+}
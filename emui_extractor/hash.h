@@ -0,0 +1,26 @@
+#ifndef EMUI_EXTRACTOR_HASH_H_
+#define EMUI_EXTRACTOR_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static const uint64_t kHash64Seed = 0xcbf29ce484222325ULL;
+
+// FNV-1a over 8 byte words, good enough to notice changed data. Not meant
+// to resist deliberate collisions.
+inline uint64_t Hash64(const uint8_t *p, size_t len, uint64_t h) {
+  const uint64_t kPrime = 0x100000001b3ULL;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, sizeof(v));
+    h = (h ^ v) * kPrime;
+  }
+  for (; i < len; ++i) {
+    h = (h ^ p[i]) * kPrime;
+  }
+  return h;
+}
+
+#endif  // EMUI_EXTRACTOR_HASH_H_
@@ -1,126 +1,1043 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
+#include "crc16.h"
+#include "detect.h"
+#include "file_range.h"
+#include "hash.h"
 #include "image.h"
+#include "worker_pool.h"
 
 using namespace std;
 
-bool Image::Dump(const string &out_fn) const {
-  int fd = open(out_fn.c_str(), O_WRONLY | O_CREAT,
+// Chunk size when an image has to be copied through user space.
+static const size_t kDumpBufSize = 8 * 1024 * 1024;
+// Images are dumped in pieces of this size so big ones run in parallel.
+static const size_t kDumpChunk = 64 * 1024 * 1024;
+
+void Image::CrcTally::Add(uint32_t block) {
+  ++bad;
+  uint32_t first = first_bad;
+  while (block < first && !first_bad.compare_exchange_weak(first, block)) {
+  }
+}
+
+bool Image::HasCrcTable() const {
+  size_t blocks = (hdr_->data_len_ + kCrcBlockSize - 1) / kCrcBlockSize;
+  return hdr_->hdr_len_ >= kHdrFixedLen + blocks * sizeof(uint16_t);
+}
+
+bool Image::CheckHdr() const {
+  if (hdr_->hdr_checksum_ == 0) {
+    return true;
+  }
+  // The checksum covers the whole header with its own field zeroed.
+  vector<uint8_t> hdr(reinterpret_cast<const uint8_t *>(hdr_.get()),
+                      reinterpret_cast<const uint8_t *>(hdr_.get()) +
+                          hdr_->hdr_len_);
+  memset(&hdr[offsetof(ImageHdr, hdr_checksum_)], 0,
+         sizeof(hdr_->hdr_checksum_));
+  return Crc16(hdr.data(), hdr.size()) == hdr_->hdr_checksum_;
+}
+
+void Image::CheckBlocks(const uint8_t *data, off_t off, size_t len,
+                        CrcTally *crc) const {
+  for (size_t done = 0; done < len; done += kCrcBlockSize) {
+    size_t n = len - done < kCrcBlockSize ? len - done : kCrcBlockSize;
+    uint32_t block = (off + done) / kCrcBlockSize;
+    uint16_t expected;
+    memcpy(&expected, hdr_->data_checksum_ + block * sizeof(expected),
+           sizeof(expected));
+    if (Crc16(data + done, n) != expected) {
+      crc->Add(block);
+    }
+  }
+}
+
+bool Image::VerifyRange(off_t off, size_t len, CrcTally *crc) const {
+  unique_ptr<uint8_t[]> buf;
+  while (len) {
+    size_t n = len < kDumpBufSize ? len : kDumpBufSize;
+    const uint8_t *p;
+    if (image_file_->map_) {
+      p = image_file_->map_ + data_off_ + off;
+    } else {
+      if (!buf) {
+        buf.reset(new uint8_t[kDumpBufSize]);
+      }
+      if (!image_file_->ReadAt(data_off_ + off, buf.get(), n)) {
+        return false;
+      }
+      p = buf.get();
+    }
+    CheckBlocks(p, off, n, crc);
+    off += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool Image::DumpRange(int fd, off_t off, size_t len, off_t out_off,
+                      CrcTally *crc) const {
+  // Let the kernel move the data when it can. Verification needs to see the
+  // data, so it goes through the mapping instead.
+  loff_t base = image_file_->base_;
+  loff_t in = base + data_off_ + off;
+  loff_t out = out_off;
+  while (len && !crc && !image_file_->inflater_) {
+    ssize_t count = copy_file_range(image_file_->fd_, &in, fd, &out, len, 0);
+    if (count <= 0) {
+      if (count == 0 || (errno != EXDEV && errno != EINVAL &&
+                         errno != ENOSYS && errno != EOPNOTSUPP)) {
+        fprintf(stderr, "error copy %s: %s\n", hdr_->type_,
+                count ? strerror(errno) : "unexpected EOF");
+        return false;
+      }
+      break;
+    }
+    len -= count;
+  }
+  off = in - base - data_off_;
+  out_off = out;
+
+  // Otherwise write straight from the mapping, or through a big buffer.
+  unique_ptr<uint8_t[]> buf;
+  while (len) {
+    size_t n = len < kDumpBufSize ? len : kDumpBufSize;
+    const uint8_t *p;
+    if (image_file_->map_) {
+      p = image_file_->map_ + data_off_ + off;
+    } else {
+      if (!buf) {
+        buf.reset(new uint8_t[kDumpBufSize]);
+      }
+      if (!image_file_->ReadAt(data_off_ + off, buf.get(), n)) {
+        return false;
+      }
+      p = buf.get();
+    }
+    if (crc) {
+      CheckBlocks(p, off, n, crc);
+    }
+    if (pwrite(fd, p, n, out_off) != static_cast<ssize_t>(n)) {
+      fprintf(stderr, "error write %s: %s\n", hdr_->type_, strerror(errno));
+      return false;
+    }
+    off += n;
+    out_off += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool Image::FillRange(int fd, off_t out_off, size_t len,
+                      uint32_t pattern) const {
+  // Zero fills are left as holes of the freshly truncated output.
+  if (pattern == 0) {
+    return true;
+  }
+  size_t buf_len = len < kDumpBufSize ? len : kDumpBufSize;
+  unique_ptr<uint32_t[]> buf(new uint32_t[buf_len / sizeof(pattern) + 1]);
+  for (size_t i = 0; i <= buf_len / sizeof(pattern); ++i) {
+    buf[i] = pattern;
+  }
+  while (len) {
+    size_t n = len < buf_len ? len : buf_len;
+    if (pwrite(fd, buf.get(), n, out_off) != static_cast<ssize_t>(n)) {
+      fprintf(stderr, "error write %s: %s\n", hdr_->type_, strerror(errno));
+      return false;
+    }
+    out_off += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool Image::Plan(bool raw, uint64_t *out_size, vector<Piece> *pieces) const {
+  uint32_t size = hdr_->data_len_;
+  pieces->clear();
+  *out_size = size;
+
+  // Only look at what can identify the format.
+  size_t head_len = size < kDetectLen ? size : kDetectLen;
+  vector<uint8_t> head(head_len);
+  if (raw && !image_file_->ReadAt(data_off_, head.data(), head_len)) {
+    return false;
+  }
+  Format format;
+  if (raw) {
+    format = DetectFormat(head.data(), head_len);
+  }
+  size_t skip = format.prefix;
+
+  if (format.name != "sparse") {
+    *out_size = size - skip;
+    for (uint64_t off = 0; off < *out_size; off += kDumpChunk) {
+      size_t len = *out_size - off < kDumpChunk ? *out_size - off : kDumpChunk;
+      pieces->push_back({static_cast<off_t>(skip + off),
+                         static_cast<off_t>(off), len, false, 0});
+    }
+    return true;
+  }
+  return PlanSparse(skip, out_size, pieces);
+}
+
+bool Image::PlanSparse(off_t off, uint64_t *out_size,
+                       vector<Piece> *pieces) const {
+  uint32_t size = hdr_->data_len_;
+  SparseHdr sh;
+  if (size - off < sizeof(sh) ||
+      !image_file_->ReadAt(data_off_ + off, reinterpret_cast<uint8_t *>(&sh),
+                            sizeof(sh)) ||
+      sh.magic != kSparseMagic || sh.file_hdr_sz < sizeof(sh) ||
+      sh.chunk_hdr_sz < sizeof(SparseChunk) ||
+      sh.blk_sz == 0 || sh.blk_sz % 4) {
+    fprintf(stderr, "%s: bad sparse header\n", hdr_->type_);
+    return false;
+  }
+  off += sh.file_hdr_sz;
+  uint64_t out_off = 0;
+  for (uint32_t i = 0; i < sh.total_chunks; ++i) {
+    SparseChunk ch;
+    if (size - off < sh.chunk_hdr_sz ||
+        !image_file_->ReadAt(data_off_ + off, reinterpret_cast<uint8_t *>(&ch),
+                            sizeof(ch)) ||
+        ch.total_sz < sh.chunk_hdr_sz || ch.total_sz > size - off) {
+      fprintf(stderr, "%s: truncated sparse chunk %u\n", hdr_->type_, i);
+      return false;
+    }
+    off_t data = off + sh.chunk_hdr_sz;
+    uint64_t len = static_cast<uint64_t>(ch.chunk_sz) * sh.blk_sz;
+    switch (ch.chunk_type) {
+      case kChunkRaw:
+        if (ch.total_sz - sh.chunk_hdr_sz != len) {
+          fprintf(stderr, "%s: bad sparse chunk %u\n", hdr_->type_, i);
+          return false;
+        }
+        for (uint64_t done = 0; done < len; done += kDumpChunk) {
+          size_t n = len - done < kDumpChunk ? len - done : kDumpChunk;
+          pieces->push_back({static_cast<off_t>(data + done),
+                             static_cast<off_t>(out_off + done), n, false, 0});
+        }
+        break;
+      case kChunkFill: {
+        uint32_t pattern;
+        if (ch.total_sz - sh.chunk_hdr_sz < sizeof(pattern) ||
+            !image_file_->ReadAt(data_off_ + data,
+                                 reinterpret_cast<uint8_t *>(&pattern),
+                                 sizeof(pattern))) {
+          fprintf(stderr, "%s: bad sparse chunk %u\n", hdr_->type_, i);
+          return false;
+        }
+        if (pattern) {
+          pieces->push_back({-1, static_cast<off_t>(out_off), len, true,
+                             pattern});
+        }
+        break;
+      }
+      case kChunkDontCare:
+      case kChunkCrc32:
+        break;
+      default:
+        fprintf(stderr, "%s: unknown sparse chunk type 0x%x\n", hdr_->type_,
+                ch.chunk_type);
+        return false;
+    }
+    if (ch.chunk_type != kChunkCrc32) {
+      out_off += len;
+    }
+    off += ch.total_sz;
+  }
+  *out_size = out_off;
+  return true;
+}
+
+bool Image::DumpPiece(int fd, const Piece &piece, CrcTally *crc) const {
+  if (piece.fill) {
+    return FillRange(fd, piece.out_off, piece.len, piece.pattern);
+  }
+  return DumpRange(fd, piece.in_off, piece.len, piece.out_off, crc);
+}
+
+static int CreateOutput(const string &out_fn, off_t size) {
+  int fd = open(out_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
                 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
   if (fd == -1) {
     fprintf(stderr, "error open %s: %s\n", out_fn.c_str(), strerror(errno));
-    return false;
+    return -1;
+  }
+  if (ftruncate(fd, size) == -1) {
+    fprintf(stderr, "error truncate %s: %s\n", out_fn.c_str(), strerror(errno));
+    close(fd);
+    return -1;
   }
+  return fd;
+}
 
+bool Image::Dump(const string &out_fn, bool raw) const {
   DBG("dumping %s size: %d off: 0x%lx\n", hdr_->type_, hdr_->data_len_,
       data_off_);
+  uint64_t out_size;
+  vector<Piece> pieces;
+  if (!Plan(raw, &out_size, &pieces)) {
+    return false;
+  }
+  int fd = CreateOutput(out_fn, out_size);
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = true;
+  for (const Piece &piece : pieces) {
+    ok = ok && DumpPiece(fd, piece, nullptr);
+  }
+  close(fd);
+  return ok;
+}
 
-  if (image_file_->SetPosition(data_off_)) {
-    char buf[4096];
-    uint32_t total = hdr_->data_len_;
-    while (total) {
-      // DBG("0x%x\n", total);
-      uint32_t to_read = total <= sizeof(buf) ? total : sizeof(buf);
-      if (image_file_->Read(reinterpret_cast<uint8_t*>(buf), to_read)) {
-        if (write(fd, buf, to_read) != to_read) {
-          fprintf(stderr, "error write %s: %s\n", out_fn.c_str(), strerror(errno));
-          close(fd);
-          return false;
+bool Image::Read(off_t off, uint8_t *buf, size_t len) const {
+  if (off < 0 || off + len > hdr_->data_len_) {
+    return false;
+  }
+  return image_file_->ReadAt(data_off_ + off, buf, len);
+}
+
+bool Image::Extent(off_t *off, uint64_t *len) const {
+  if (image_file_->inflater_) {
+    return false;
+  }
+  *off = image_file_->base_ + data_off_;
+  *len = hdr_->data_len_;
+  return true;
+}
+
+bool Image::View::Open(shared_ptr<Image> img, bool raw) {
+  img_ = img;
+  return img_->Plan(raw, &size_, &pieces_);
+}
+
+ssize_t Image::View::Read(uint64_t off, uint8_t *buf, size_t len) const {
+  if (off >= size_) {
+    return 0;
+  }
+  len = min<uint64_t>(len, size_ - off);
+  // Pieces are in output order; find the first one ending after |off|.
+  auto it = upper_bound(pieces_.begin(), pieces_.end(), off,
+                        [](uint64_t o, const Piece &p) {
+                          return o < p.out_off + p.len;
+                        });
+  for (size_t done = 0; done < len;) {
+    uint64_t pos = off + done;
+    size_t n = len - done;
+    if (it == pieces_.end() || pos < static_cast<uint64_t>(it->out_off)) {
+      if (it != pieces_.end()) {
+        n = min<uint64_t>(n, it->out_off - pos);
+      }
+      memset(buf + done, 0, n);
+    } else {
+      uint64_t in = pos - it->out_off;
+      n = min<uint64_t>(n, it->len - in);
+      if (it->fill) {
+        const uint8_t *pattern =
+            reinterpret_cast<const uint8_t *>(&it->pattern);
+        for (size_t i = 0; i < n; ++i) {
+          buf[done + i] = pattern[(in + i) % sizeof(it->pattern)];
         }
-        total -= to_read;
-      } else {
-        close(fd);
+      } else if (!img_->Read(it->in_off + in, buf + done, n)) {
+        return -1;
+      }
+      ++it;
+    }
+    done += n;
+  }
+  return len;
+}
+
+bool Image::Stream(int fd) const {
+  // sendfile() moves the data inside the kernel, to a pipe as well as to a
+  // file. Fall back to writing through user space if it can't.
+  off_t base = image_file_->base_;
+  off_t off = base + data_off_;
+  size_t len = hdr_->data_len_;
+  while (len && !image_file_->inflater_) {
+    ssize_t count = sendfile(fd, image_file_->fd_, &off, len);
+    if (count <= 0) {
+      if (count == 0 || (errno != EINVAL && errno != ENOSYS) ||
+          off != base + data_off_) {
+        fprintf(stderr, "error send %s: %s\n", hdr_->type_,
+                count ? strerror(errno) : "unexpected EOF");
         return false;
       }
+      break;
     }
-    close(fd);
-    return true;
+    len -= count;
   }
-  close(fd);
-  return false;
+  off -= base;
+  unique_ptr<uint8_t[]> buf;
+  while (len) {
+    size_t n = len < kDumpBufSize ? len : kDumpBufSize;
+    const uint8_t *p;
+    if (image_file_->map_) {
+      p = image_file_->map_ + off;
+    } else {
+      if (!buf) {
+        buf.reset(new uint8_t[kDumpBufSize]);
+      }
+      if (!image_file_->ReadAt(off, buf.get(), n)) {
+        return false;
+      }
+      p = buf.get();
+    }
+    for (size_t done = 0; done < n;) {
+      ssize_t count = write(fd, p + done, n - done);
+      if (count <= 0) {
+        fprintf(stderr, "error write %s: %s\n", hdr_->type_, strerror(errno));
+        return false;
+      }
+      done += count;
+    }
+    off += n;
+    len -= n;
+  }
+  return true;
 }
 
-RoImageFile::RoImageFile(const char *file_name) : file_name_(file_name) {
-  fd_ = open(file_name, O_RDONLY);
-  if (fd_ == -1) {
-    fprintf(stderr, "error open %s: %s\n", file_name, strerror(errno));
+static const size_t kTarBlock = 512;
+
+static bool WriteAll(int fd, const void *buf, size_t len) {
+  const uint8_t *p = static_cast<const uint8_t *>(buf);
+  while (len) {
+    ssize_t count = write(fd, p, len);
+    if (count <= 0) {
+      fprintf(stderr, "error write tar: %s\n", strerror(errno));
+      return false;
+    }
+    p += count;
+    len -= count;
+  }
+  return true;
+}
+
+// Takes the build time in the header as the file time, 0 if unreadable.
+static time_t ImageTime(const Image::ImageHdr &hdr) {
+  char date[sizeof(hdr.date_) + 1] = {};
+  char tm_str[sizeof(hdr.time_) + 1] = {};
+  memcpy(date, hdr.date_, sizeof(hdr.date_));
+  memcpy(tm_str, hdr.time_, sizeof(hdr.time_));
+  struct tm tm = {};
+  if (sscanf(date, "%d.%d.%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3) {
+    return 0;
+  }
+  sscanf(tm_str, "%d.%d.%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  time_t t = timegm(&tm);
+  return t == -1 ? 0 : t;
+}
+
+// Writes |value| to the |len| byte numeric field at |field|: as octal
+// digits and a NUL when it fits, else in the base-256 form of GNU tar, as
+// for images of 8 GiB and more.
+static void TarNumber(char *field, size_t len, uint64_t value) {
+  if (value >> (3 * (len - 1)) == 0) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%0*llo", static_cast<int>(len - 1),
+             static_cast<unsigned long long>(value));
+    memcpy(field, digits, len);
     return;
   }
+  field[0] = static_cast<char>(0x80);
+  for (size_t i = len - 1; i > 0; --i) {
+    field[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+// Fills a ustar header block for a regular file.
+static void TarHeader(const string &name, uint64_t size, time_t mtime,
+                      uint8_t *block) {
+  char *h = reinterpret_cast<char *>(block);
+  memset(h, 0, kTarBlock);
+  strncpy(h, name.c_str(), 99);
+  snprintf(h + 100, 8, "%07o", 0644);
+  snprintf(h + 108, 8, "%07o", 0);
+  snprintf(h + 116, 8, "%07o", 0);
+  TarNumber(h + 124, 12, size);
+  TarNumber(h + 136, 12, mtime < 0 ? 0 : mtime);
+  h[156] = '0';
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+  memset(h + 148, ' ', 8);
+  unsigned sum = 0;
+  for (size_t i = 0; i < kTarBlock; ++i) {
+    sum += block[i];
+  }
+  snprintf(h + 148, 8, "%06o", sum);
+}
+
+bool RoImageFile::ExportTar(const vector<shared_ptr<Image>> &images,
+                            int fd) const {
+  uint8_t block[kTarBlock];
+  for (const auto &img : images) {
+    const Image::ImageHdr &hdr = *img->hdr_;
+    string name(reinterpret_cast<const char *>(hdr.type_),
+                strnlen(reinterpret_cast<const char *>(hdr.type_),
+                        sizeof(hdr.type_)));
+    TarHeader(name + ".img", hdr.data_len_, ImageTime(hdr), block);
+    if (!WriteAll(fd, block, kTarBlock) || !img->Stream(fd)) {
+      return false;
+    }
+    size_t pad = (kTarBlock - hdr.data_len_ % kTarBlock) % kTarBlock;
+    memset(block, 0, kTarBlock);
+    if (!WriteAll(fd, block, pad)) {
+      return false;
+    }
+  }
+  // Two zero blocks end the archive.
+  memset(block, 0, kTarBlock);
+  return WriteAll(fd, block, kTarBlock) && WriteAll(fd, block, kTarBlock);
+}
+
+// Prints CRC problems of |img|, returns false if there are any.
+static bool ReportCrc(const Image &img, const Image::CrcTally &crc,
+                      FILE *out) {
+  const char *type = reinterpret_cast<const char *>(img.GetHdr()->type_);
+  bool ok = true;
+  if (!img.CheckHdr()) {
+    fprintf(out, "%s: bad header checksum\n", type);
+    ok = false;
+  }
+  if (!img.HasCrcTable()) {
+    fprintf(out, "%s: no block CRC table\n", type);
+    ok = false;
+  } else if (crc.bad) {
+    fprintf(out, "%s: %zu bad blocks, first at offset 0x%lx\n", type,
+            crc.bad.load(),
+            static_cast<unsigned long>(crc.first_bad) * Image::kCrcBlockSize);
+    ok = false;
+  }
+  return ok;
+}
+
+void RoImageFile::Advise(off_t off, size_t len, int advice) const {
+  // Hints only make sense where the package is in the file as is.
+  if (!inflater_ && len) {
+    posix_fadvise(fd_, base_ + off, len, advice);
+  }
+}
+
+bool RoImageFile::DumpImages(
+    const vector<pair<shared_ptr<Image>, string>> &jobs, unsigned threads,
+    bool verify, bool raw) const {
+  struct Output {
+    int fd;
+    atomic<bool> ok;
+    Image::CrcTally crc;
+  };
+  // One read of the package, at |off| of it.
+  struct Step {
+    off_t off;
+    size_t len;
+    function<void()> run;
+  };
+  vector<pair<const Image *, unique_ptr<Output>>> outputs;
+  vector<Step> plan;
+  bool ok = true;
+  for (const auto &job : jobs) {
+    const shared_ptr<Image> &img = job.first;
+    uint32_t size = img->hdr_->data_len_;
+    DBG("dumping %s size: %d off: 0x%lx\n", img->hdr_->type_, size,
+        img->data_off_);
+    uint64_t out_size;
+    vector<Image::Piece> pieces;
+    if (!img->Plan(raw, &out_size, &pieces)) {
+      ok = false;
+      continue;
+    }
+    int fd = CreateOutput(job.second, out_size);
+    if (fd == -1) {
+      ok = false;
+      continue;
+    }
+    outputs.emplace_back(img.get(), unique_ptr<Output>(new Output));
+    Output *out = outputs.back().second.get();
+    out->fd = fd;
+    out->ok = true;
+
+    // CRCs cover the packaged bytes, so they can only be checked in the
+    // copy when the output is a plain copy. Otherwise check the packaged
+    // bytes on their own, while they are still in the page cache.
+    bool plain = true;
+    for (const auto &piece : pieces) {
+      plain = plain && !piece.fill && piece.in_off == piece.out_off;
+    }
+    Image::CrcTally *crc = verify && img->HasCrcTable() ? &out->crc : nullptr;
+    Image::CrcTally *fused = plain ? crc : nullptr;
+    for (const auto &piece : pieces) {
+      off_t off = img->data_off_ + (piece.fill ? 0 : piece.in_off);
+      size_t len = piece.fill ? 0 : piece.len;
+      plan.push_back({off, len, [img, out, piece, fused] {
+        if (out->ok && !img->DumpPiece(out->fd, piece, fused)) {
+          out->ok = false;
+        }
+      }});
+    }
+    if (crc && !plain) {
+      for (uint32_t off = 0; off < size; off += kDumpChunk) {
+        size_t len = size - off < kDumpChunk ? size - off : kDumpChunk;
+        plan.push_back({img->data_off_ + off, len, [img, out, off, len, crc] {
+          if (!img->VerifyRange(off, len, crc)) {
+            out->ok = false;
+          }
+        }});
+      }
+    }
+  }
+
+  // Read the package front to back, whatever order the images were asked
+  // for in, and have the kernel fetch a step ahead of each worker.
+  stable_sort(plan.begin(), plan.end(), [](const Step &a, const Step &b) {
+    return a.off < b.off;
+  });
+  Advise(0, size_, POSIX_FADV_SEQUENTIAL);
+  size_t ahead = threads ? threads : 1;
+  for (size_t i = 0; i < ahead && i < plan.size(); ++i) {
+    Advise(plan[i].off, plan[i].len, POSIX_FADV_WILLNEED);
+  }
+  {
+    // No more workers than steps, however many were asked for.
+    WorkerPool pool(min<size_t>(threads, plan.size()));
+    for (size_t i = 0; i < plan.size(); ++i) {
+      pool.Submit([this, &plan, i, ahead] {
+        if (i + ahead < plan.size()) {
+          Advise(plan[i + ahead].off, plan[i + ahead].len,
+                 POSIX_FADV_WILLNEED);
+        }
+        plan[i].run();
+      });
+    }
+    pool.Wait();
+  }
+  Advise(0, size_, POSIX_FADV_NORMAL);
+
+  for (const auto &out : outputs) {
+    ok = ok && out.second->ok;
+    if (verify && !ReportCrc(*out.first, out.second->crc, stderr)) {
+      ok = false;
+    }
+    close(out.second->fd);
+  }
+  return ok;
+}
+
+bool RoImageFile::VerifyImages(const vector<shared_ptr<Image>> &images,
+                               unsigned threads) const {
+  vector<unique_ptr<Image::CrcTally>> tallies;
+  atomic<bool> io_ok(true);
+  size_t chunks = 0;
+  for (const auto &img : images) {
+    if (img->HasCrcTable()) {
+      chunks += (img->hdr_->data_len_ + kDumpChunk - 1) / kDumpChunk;
+    }
+  }
+  {
+    WorkerPool pool(min<size_t>(threads, chunks));
+    for (const auto &img : images) {
+      tallies.emplace_back(new Image::CrcTally);
+      Image::CrcTally *crc = tallies.back().get();
+      if (!img->HasCrcTable()) {
+        continue;
+      }
+      uint32_t size = img->hdr_->data_len_;
+      for (uint32_t off = 0; off < size; off += kDumpChunk) {
+        size_t len = size - off < kDumpChunk ? size - off : kDumpChunk;
+        pool.Submit([img, off, len, crc, &io_ok] {
+          if (!img->VerifyRange(off, len, crc)) {
+            io_ok = false;
+          }
+        });
+      }
+    }
+    pool.Wait();
+  }
+  bool ok = io_ok;
+  for (size_t i = 0; i < images.size(); ++i) {
+    if (ReportCrc(*images[i], *tallies[i], stdout)) {
+      fprintf(stdout, "%s: OK\n", images[i]->hdr_->type_);
+    } else {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+unique_ptr<RoImageFile> RoImageFile::Open(const string &file_name, Error *err,
+                                          bool use_index) {
+  unique_ptr<RoImageFile> file(new RoImageFile(file_name));
+  *err = file->Map();
+  if (err->ok()) {
+    *err = file->Load(use_index);
+  }
+  if (!err->ok()) {
+    file.reset();
+  }
+  return file;
+}
+
+Error RoImageFile::Map() {
+  // A name that doesn't exist but has a '!' may be a zip entry, and one
+  // with an '@' after any '!' a byte range.
+  string path = file_name_;
+  string entry_name;
+  FileRange range;
+  size_t bang = file_name_.rfind('!');
+  size_t at = file_name_.rfind('@');
+  if (access(file_name_.c_str(), F_OK) == -1) {
+    if (at != string::npos && (bang == string::npos || at > bang)) {
+      Error err = ResolveRange(file_name_, &range);
+      if (!err.ok()) {
+        return err;
+      }
+      path = range.path;
+    } else if (bang != string::npos) {
+      path = file_name_.substr(0, bang);
+      entry_name = file_name_.substr(bang + 1);
+    }
+  }
+  path_ = path;
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ == -1) {
+    return Error(Error::kOpen, "error open " + path, errno);
+  }
   struct stat buf;
   if (fstat(fd_, &buf) == -1) {
-    fprintf(stderr, "error stat %s: %s\n", file_name, strerror(errno));
-    return;
+    return Error(Error::kOpen, "error stat " + path, errno);
   }
-  state_ = kGoodBit;
+  file_size_ = buf.st_size;
   size_ = buf.st_size;
+  mtime_ = buf.st_mtim;
+
+  void *map = file_size_ ? mmap(nullptr, file_size_, PROT_READ, MAP_SHARED,
+                                fd_, 0)
+                         : MAP_FAILED;
+  if (map == MAP_FAILED) {
+    DBG("mmap %s failed, using pread()\n", path.c_str());
+  } else {
+    file_map_ = reinterpret_cast<const uint8_t *>(map);
+    map_ = file_map_;
+  }
+  if (!range.path.empty()) {
+    base_ = range.offset;
+    size_ = range.size;
+    map_ = file_map_ ? file_map_ + base_ : nullptr;
+    return Error();
+  }
+  if (entry_name.empty()) {
+    return Error();
+  }
+
+  ZipEntry entry;
+  Error err = FindZipEntry(fd_, file_size_, entry_name, &entry);
+  if (!err.ok()) {
+    return Error(err.code(), path + ": " + err.message());
+  }
+  size_ = entry.size;
+  if (entry.stored) {
+    base_ = entry.offset;
+    map_ = file_map_ ? file_map_ + base_ : nullptr;
+    return Error();
+  }
+  map_ = nullptr;
+  inflater_.reset(new Inflater);
+  err = inflater_->Build(fd_, entry);
+  if (!err.ok()) {
+    return Error(err.code(), file_name_ + ": " + err.message());
+  }
+  return Error();
+}
+
+Error RoImageFile::Load(bool use_index) {
+  if (use_index) {
+    for (const auto &path : IndexPaths()) {
+      if (LoadIndex(path)) {
+        DBG("Loaded images from %s\n", path.c_str());
+        return Error();
+      }
+    }
+  }
+  Error err = Scan();
+  if (err.ok() && use_index) {
+    SaveIndex();
+  }
+  return err;
 }
 
-bool RoImageFile::Load() {
+Error RoImageFile::Scan() {
   DBG("Begin load images...\n");
+  const Error read_err(Error::kRead, "error read " + file_name_, EIO);
+  off_t pos = 0;
   uint32_t magic, hdr_len;
-  while (Read(reinterpret_cast<uint8_t *>(&magic), sizeof(magic))) {
-    DBG("Now position: 0x%lx\n", GetPosition());
-    if (magic == Image::kMagic) {
-      if (Read(reinterpret_cast<uint8_t *>(&hdr_len), sizeof(hdr_len))) {
-        Skip(-(sizeof(magic) + sizeof(hdr_len)));
-        off_t pos = GetPosition();
-        // shared_ptr<Image::ImageHdr> hdr(
-        //     reinterpret_cast<Image::ImageHdr *>(new uint8_t[hdr_len]),
-        //     [](Image::ImageHdr *p) { delete[] reinterpret_cast<uint8_t*>(p);
-        //     });
-        shared_ptr<Image::ImageHdr> hdr(
-            reinterpret_cast<Image::ImageHdr *>(malloc(hdr_len)), free);
-        if (Read(reinterpret_cast<uint8_t *>(hdr.get()), hdr_len)) {
-          shared_ptr<Image> image = make_shared<Image>(hdr, this, pos);
-          images_.push_back(image);
-
-          Skip(hdr->data_len_);
-          SkipAlign();
-          DBG("Got new header %s\n", hdr->type_);
-          continue;
-        }
-      }
+  while (pos + static_cast<off_t>(sizeof(magic) + sizeof(hdr_len)) <= size_) {
+    if (!ReadAt(pos, reinterpret_cast<uint8_t *>(&magic), sizeof(magic))) {
+      return read_err;
+    }
+    DBG("Now position: 0x%lx\n", pos);
+    if (magic != Image::kMagic) {
+      pos += sizeof(magic);
+      continue;
+    }
+    if (!ReadAt(pos + sizeof(magic), reinterpret_cast<uint8_t *>(&hdr_len),
+                sizeof(hdr_len))) {
+      return read_err;
+    }
+    if (hdr_len < Image::kHdrFixedLen || pos + hdr_len > size_) {
+      pos += sizeof(magic);
+      continue;
+    }
+    shared_ptr<Image::ImageHdr> hdr(
+        reinterpret_cast<Image::ImageHdr *>(malloc(hdr_len)), free);
+    if (!ReadAt(pos, reinterpret_cast<uint8_t *>(hdr.get()), hdr_len)) {
+      return read_err;
     }
+    if (pos + hdr_len + hdr->data_len_ > size_) {
+      fprintf(stderr, "%s: truncated at %.32s\n", file_name_.c_str(),
+              hdr->type_);
+      break;
+    }
+    shared_ptr<Image> image = make_shared<Image>(hdr, this, pos);
+    images_.push_back(image);
+    DBG("Got new header %s\n", hdr->type_);
+    pos = Align(pos + hdr_len + hdr->data_len_);
   }
   DBG("End load images\n");
-  return Eof();
-}
-
-RoImageFile &RoImageFile::Read(uint8_t *buf, size_t buf_sz) {
-  if (Good()) {
-    ssize_t count = read(fd_, buf, buf_sz);
-    if (count == -1) {
-      fprintf(stderr, "error read %s: %s\n", file_name_, strerror(errno));
-      state_ |= kBadBit;
-    } else if (count < static_cast<ssize_t>(buf_sz)) {
-      // fprintf(stderr, "error read %s: EOF\n", file_name_);
-      position_ += count;
-      state_ |= kEofBit;
-    } else {
-      position_ += count;
+  if (images_.empty()) {
+    return Error(Error::kFormat, file_name_ + ": no images found");
+  }
+  return Error();
+}
+
+bool RoImageFile::ReadAt(off_t off, uint8_t *buf, size_t buf_sz) const {
+  if (off + static_cast<off_t>(buf_sz) > size_) {
+    return false;
+  }
+  if (map_) {
+    memcpy(buf, map_ + off, buf_sz);
+    return true;
+  }
+  if (inflater_) {
+    return inflater_->Read(off, buf, buf_sz);
+  }
+  off += base_;
+  while (buf_sz) {
+    ssize_t count = pread(fd_, buf, buf_sz, off);
+    if (count <= 0) {
+      fprintf(stderr, "error read %s: %s\n", file_name_.c_str(),
+              count ? strerror(errno) : "unexpected EOF");
+      return false;
+    }
+    buf += count;
+    off += count;
+    buf_sz -= count;
+  }
+  return true;
+}
+
+////////////////// INDEX //////////////////
+static const char kIndexMagic[8] = {'E', 'M', 'U', 'I', 'I', 'D', 'X', '1'};
+static const int kIndexSamples = 16;
+static const size_t kIndexSampleSize = 4096;
+
+struct IndexHeader {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t sample_hash;
+  uint64_t body_hash;
+  uint32_t count;
+  uint32_t body_len;
+};
+
+struct IndexEntry {
+  uint64_t hdr_off;
+  uint32_t hdr_len;
+  uint32_t reserved;
+};
+
+static bool MakeDirs(const string &path) {
+  for (size_t pos = 1; pos != string::npos; ++pos) {
+    pos = path.find('/', pos);
+    string dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+      return false;
     }
+    if (pos == string::npos) {
+      break;
+    }
+  }
+  return true;
+}
+
+vector<string> RoImageFile::IndexPaths() const {
+  // Zip entries and byte ranges are keyed by the file's path, with the
+  // rest of the name flattened so the sidecar sits next to the file.
+  string path = path_;
+  string entry = file_name_.substr(path_.size());
+  for (char &c : entry) {
+    c = c == '/' ? '_' : c;
+  }
+  vector<string> paths;
+  paths.push_back(path + entry + ".idx");
+
+  string cache;
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg && xdg[0]) {
+    cache = xdg;
+  } else if (home && home[0]) {
+    cache = string(home) + "/.cache";
   } else {
-    DBG("Bad state, not read\n");
+    return paths;
   }
-  return *this;
+  char *real = realpath(path.c_str(), nullptr);
+  if (!real) {
+    return paths;
+  }
+  string key = string(real) + entry;
+  free(real);
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.idx",
+           static_cast<unsigned long long>(Hash64(
+               reinterpret_cast<const uint8_t *>(key.data()), key.size(),
+               kHash64Seed)));
+  paths.push_back(cache + "/emui_extractor/" + name);
+  return paths;
+}
+
+uint64_t RoImageFile::SampleHash() const {
+  uint64_t h = kHash64Seed;
+  uint8_t buf[kIndexSampleSize];
+  for (int i = 0; i < kIndexSamples; ++i) {
+    off_t off = size_ <= static_cast<off_t>(kIndexSampleSize)
+                    ? 0
+                    : (size_ - kIndexSampleSize) / (kIndexSamples - 1) * i;
+    size_t len = size_ - off < static_cast<off_t>(kIndexSampleSize)
+                     ? size_ - off
+                     : kIndexSampleSize;
+    if (!ReadAt(off, buf, len)) {
+      return 0;
+    }
+    h = Hash64(buf, len, h);
+  }
+  return h;
 }
 
-RoImageFile &RoImageFile::Skip(off_t sz) {
-  position_ += sz;
-  if (position_ > size_) {
-    position_ = size_;
-  } else if (position_ < 0) {
-    position_ = 0;
+bool RoImageFile::LoadIndex(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
   }
-  if (lseek(fd_, position_, SEEK_SET) == -1) {
-    state_ |= kBadBit;
+  IndexHeader ih;
+  vector<uint8_t> body;
+  bool ok = read(fd, &ih, sizeof(ih)) == sizeof(ih) &&
+            memcmp(ih.magic, kIndexMagic, sizeof(kIndexMagic)) == 0 &&
+            ih.size == static_cast<uint64_t>(size_) &&
+            ih.mtime_sec == mtime_.tv_sec && ih.mtime_nsec == mtime_.tv_nsec;
+  if (ok) {
+    body.resize(ih.body_len);
+    ok = read(fd, body.data(), body.size()) ==
+             static_cast<ssize_t>(body.size()) &&
+         Hash64(body.data(), body.size(), 0) == ih.body_hash &&
+         SampleHash() == ih.sample_hash;
   }
-  if ((state_ | kEofBit) != 0 && position_ < size_) {
-    state_ &= ~kEofBit;
+  close(fd);
+  if (!ok) {
+    DBG("Index %s is stale\n", path.c_str());
+    return false;
+  }
+
+  vector<shared_ptr<Image>> images;
+  size_t pos = 0;
+  for (uint32_t i = 0; i < ih.count; ++i) {
+    IndexEntry e;
+    if (pos + sizeof(e) > body.size()) {
+      return false;
+    }
+    memcpy(&e, &body[pos], sizeof(e));
+    pos += sizeof(e);
+    if (e.hdr_len < Image::kHdrFixedLen || pos + e.hdr_len > body.size()) {
+      return false;
+    }
+    shared_ptr<Image::ImageHdr> hdr(
+        reinterpret_cast<Image::ImageHdr *>(malloc(e.hdr_len)), free);
+    memcpy(hdr.get(), &body[pos], e.hdr_len);
+    pos += e.hdr_len;
+    uint32_t magic;
+    memcpy(&magic, hdr->magic_, sizeof(magic));
+    if (magic != Image::kMagic || hdr->hdr_len_ != e.hdr_len ||
+        e.hdr_off + e.hdr_len + hdr->data_len_ >
+            static_cast<uint64_t>(size_)) {
+      return false;
+    }
+    images.push_back(make_shared<Image>(hdr, this, e.hdr_off));
+  }
+  images_ = move(images);
+  return true;
+}
+
+void RoImageFile::SaveIndex() const {
+  vector<uint8_t> body;
+  for (const auto &img : images_) {
+    IndexEntry e = {static_cast<uint64_t>(img->data_off_ - img->hdr_->hdr_len_),
+                    img->hdr_->hdr_len_, 0};
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&e);
+    body.insert(body.end(), p, p + sizeof(e));
+    p = reinterpret_cast<const uint8_t *>(img->hdr_.get());
+    body.insert(body.end(), p, p + img->hdr_->hdr_len_);
+  }
+  IndexHeader ih;
+  memcpy(ih.magic, kIndexMagic, sizeof(kIndexMagic));
+  ih.size = size_;
+  ih.mtime_sec = mtime_.tv_sec;
+  ih.mtime_nsec = mtime_.tv_nsec;
+  ih.sample_hash = SampleHash();
+  ih.body_hash = Hash64(body.data(), body.size(), 0);
+  ih.count = images_.size();
+  ih.body_len = body.size();
+
+  for (const auto &path : IndexPaths()) {
+    size_t slash = path.rfind('/');
+    if (slash != string::npos && slash > 0 && !MakeDirs(path.substr(0, slash))) {
+      continue;
+    }
+    // Write a temp file and rename it, so readers never see half an index.
+    // The name is unique, since other instances may be saving the same one.
+    string tmp = path + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd == -1) {
+      continue;
+    }
+    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    bool ok = write(fd, &ih, sizeof(ih)) == sizeof(ih) &&
+              write(fd, body.data(), body.size()) ==
+                  static_cast<ssize_t>(body.size());
+    close(fd);
+    if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+      DBG("Saved index %s\n", path.c_str());
+      return;
+    }
+    unlink(tmp.c_str());
   }
-  return *this;
+  DBG("Can't save index for %s\n", file_name_.c_str());
 }
+//////////////// END INDEX //////////////////
@@ -5,12 +5,19 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <string>
+#include <utility>
 #include <vector>
 #include <memory>
+#include "error.h"
+#include "zip.h"
 
 #ifdef DEBUG
   #define DBG(...) fprintf(stderr, __VA_ARGS__)
@@ -41,6 +48,18 @@ class Image {
     uint8_t data_checksum_[0];
   };
 
+  // Header size without the data_checksum_ table.
+  static const size_t kHdrFixedLen = offsetof(ImageHdr, data_checksum_);
+  // data_checksum_ holds one CRC16 per block of this size.
+  static const size_t kCrcBlockSize = 4096;
+
+  // CRC mismatches found in one image, shared by all of its chunks.
+  struct CrcTally {
+    std::atomic<size_t> bad{0};
+    std::atomic<uint32_t> first_bad{UINT32_MAX};
+    void Add(uint32_t block);
+  };
+
   // Image() : hdr_(nullptr), data_off_(0) {}
   Image(std::shared_ptr<ImageHdr> hdr, RoImageFile *ifp, off_t hdr_off)
       : hdr_(hdr), image_file_(ifp), data_off_(hdr->hdr_len_ + hdr_off) {}
@@ -49,7 +68,27 @@ class Image {
     return hdr_;
   }
 
-  bool Dump(const std::string &out_fn) const;
+  // With |raw|, a vendor prefix is dropped and a sparse image is expanded,
+  // so the output is the partition itself.
+  bool Dump(const std::string &out_fn, bool raw = false) const;
+  // Copies |len| bytes at |off| of the image to |out_off| of |fd|.
+  // With |crc|, the blocks are also checked against data_checksum_ as they
+  // pass through, so verification costs no extra I/O. |off| must then be
+  // block aligned.
+  bool DumpRange(int fd, off_t off, size_t len, off_t out_off,
+                 CrcTally *crc = nullptr) const;
+  // Reads |len| bytes at |off| of the image data.
+  bool Read(off_t off, uint8_t *buf, size_t len) const;
+  // Writes the whole image at the current position of |fd|, which may be a
+  // pipe.
+  bool Stream(int fd) const;
+  // Checks the blocks in [off, off + len) against data_checksum_.
+  bool VerifyRange(off_t off, size_t len, CrcTally *crc) const;
+
+  // True if hdr_checksum_ matches (or is unset).
+  bool CheckHdr() const;
+  // True if data_checksum_ has an entry for every block.
+  bool HasCrcTable() const;
   std::shared_ptr<ImageHdr> GetHdr() const {
     return hdr_;
   }
@@ -58,77 +97,179 @@ class Image {
   Image(const Image &) = delete;
   Image &operator=(const Image &) = delete;
 
+  // Android sparse image format.
+  static const uint32_t kSparseMagic = 0xed26ff3a;
+  static const uint16_t kChunkRaw = 0xcac1;
+  static const uint16_t kChunkFill = 0xcac2;
+  static const uint16_t kChunkDontCare = 0xcac3;
+  static const uint16_t kChunkCrc32 = 0xcac4;
+
+  struct SparseHdr {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+  };
+
+  struct SparseChunk {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+  };
+
+  // A piece of the output: |len| bytes copied from |in_off| of the image,
+  // or filled with |pattern|, at |out_off|.
+  struct Piece {
+    off_t in_off;
+    off_t out_off;
+    size_t len;
+    bool fill;
+    uint32_t pattern;
+  };
+
+  // Splits the dump into pieces that can be written in any order. Holes are
+  // left out, the output is truncated to |out_size| first.
+  bool Plan(bool raw, uint64_t *out_size, std::vector<Piece> *pieces) const;
+  bool PlanSparse(off_t off, uint64_t *out_size,
+                  std::vector<Piece> *pieces) const;
+  bool DumpPiece(int fd, const Piece &piece, CrcTally *crc) const;
+  bool FillRange(int fd, off_t out_off, size_t len, uint32_t pattern) const;
+
+  void CheckBlocks(const uint8_t *data, off_t off, size_t len,
+                   CrcTally *crc) const;
+
   std::shared_ptr<ImageHdr> hdr_;
   RoImageFile *image_file_;
   off_t data_off_;
+
+ public:
+  // What Dump() would write, read in place. Open() indexes the pieces once
+  // and Read() looks them up, so a sparse image is expanded on the fly and
+  // holes read as zeros. Read() is const and safe to call from several
+  // threads.
+  class View {
+   public:
+    bool Open(std::shared_ptr<Image> img, bool raw);
+    uint64_t size() const { return size_; }
+    // Reads up to |len| bytes at |off|. Returns the count, short only at
+    // the end, or -1 on error.
+    ssize_t Read(uint64_t off, uint8_t *buf, size_t len) const;
+
+   private:
+    std::shared_ptr<Image> img_;
+    uint64_t size_ = 0;
+    std::vector<Piece> pieces_;
+  };
+
+  // Where the image data is in the package's file: |len| bytes at |off|.
+  // False for packages that are deflated zip entries, whose bytes aren't
+  // in the file as such.
+  bool Extent(off_t *off, uint64_t *len) const;
 };
 
+// An opened UPDATE.APP. Any number of packages may be open at once, and
+// since all reads are positional, every const method may be called from
+// several threads. Images point back to their package and must not outlive
+// it.
 class RoImageFile {
   friend class Image;
  public:
-  static RoImageFile *Create(const char *file_name) {
-    DBG("Create RoImageFile\n");
-    static RoImageFile instance(file_name);
-    return &instance;
-  }
+  // Opens |file_name| and loads its image headers, from the sidecar index
+  // when |use_index| is set and the index is current. Returns null and
+  // fills |err| on failure. "archive.zip!UPDATE.APP" opens an entry of a
+  // zip archive in place: stored entries are read directly, deflated ones
+  // through inflate checkpoints. "blob.bin@OFF+LEN" and the other specs of
+  // ResolveRange() open a package that is part of a bigger file.
+  static std::unique_ptr<RoImageFile> Open(const std::string &file_name,
+                                           Error *err, bool use_index = true);
 
   const std::vector<std::shared_ptr<Image>> &GetAllImages() const {
     return images_;
   }
 
-  bool Load();
+  const std::string &file_name() const { return file_name_; }
+
+  // Images start on 4 byte boundaries.
+  static off_t Align(off_t pos) { return (pos + 3) / 4 * 4; }
+
+  // Dumps each image to its file name, splitting large images into chunks
+  // that run concurrently on |threads| workers. The chunks are read in
+  // package order, so the package is read front to back.
+  // With |verify|, CRC errors are reported and fail the dump. With |raw|,
+  // see Image::Dump().
+  bool DumpImages(
+      const std::vector<std::pair<std::shared_ptr<Image>, std::string>> &jobs,
+      unsigned threads, bool verify = false, bool raw = false) const;
+
+  // Writes |images| as a tar archive to |fd|, named after their types.
+  bool ExportTar(const std::vector<std::shared_ptr<Image>> &images,
+                 int fd) const;
+
+  // Checks the header and block CRCs of |images| concurrently and prints a
+  // line per image. Returns false if any check fails.
+  bool VerifyImages(const std::vector<std::shared_ptr<Image>> &images,
+                    unsigned threads) const;
 
   ~RoImageFile() {
+    if (file_map_) {
+      munmap(const_cast<uint8_t *>(file_map_), file_size_);
+    }
     if (fd_ >= 0) {
       close(fd_);
     }
   }
 
  private:
-  const unsigned kGoodBit = 0;
-  const unsigned kBadBit = 1;
-  const unsigned kEofBit = 2;
-
-  RoImageFile(const char *file_name);
+  explicit RoImageFile(const std::string &file_name)
+      : file_name_(file_name) {}
 
   // Do not allow copy
   RoImageFile(const RoImageFile &) = delete;
   RoImageFile &operator=(const RoImageFile &) = delete;
 
-  explicit operator bool() const {
-    return Good();
-  }
+  Error Map();
+  Error Load(bool use_index);
 
-  RoImageFile &Read(uint8_t *buf, size_t buf_sz);
-  RoImageFile &Skip(off_t sz);
-  off_t GetPosition() const { return position_; }
-  RoImageFile &SetPosition(off_t new_pos) {
-    position_ = new_pos <= size_ ? new_pos : size_;
-    if (lseek(fd_, position_, SEEK_SET) == -1) {
-      state_ |= kBadBit;
-    }
-    if ((state_ & kEofBit) == kEofBit && position_ < size_) {
-      state_ &= ~kEofBit;
-    }
-    return *this;
-  }
+  // posix_fadvise() on [off, off + len) of the package.
+  void Advise(off_t off, size_t len, int advice) const;
+
+  // Reads |buf_sz| bytes at |off|. There is no shared file position, so
+  // any number of threads may read at once.
+  bool ReadAt(off_t off, uint8_t *buf, size_t buf_sz) const;
 
-  RoImageFile &SkipAlign() {
-    off_t pos = GetPosition();
-    off_t pad = (pos + 3) / 4 * 4 - pos;
-    return Skip(pad);
-  }
 
-  bool Good() const { return state_ == kGoodBit; }
-  bool Bad() const { return (state_ & kBadBit) != 0; }
-  bool Eof() const { return (state_ & kEofBit) != 0; }
+  // Walks the whole package for image headers.
+  Error Scan();
 
+  // The index stores header offsets and raw copies, keyed by file size,
+  // mtime and a hash of a few sampled blocks. It lives next to the package
+  // or, if that isn't writable, in the user cache directory.
+  std::vector<std::string> IndexPaths() const;
+  uint64_t SampleHash() const;
+  bool LoadIndex(const std::string &path);
+  void SaveIndex() const;
 
   int fd_ = -1;
-  off_t position_ = 0;
+  // Offset of the package in fd_, non-zero for stored zip entries.
+  off_t base_ = 0;
+  // Whole file mapped read-only, null if mmap isn't possible.
+  const uint8_t *file_map_ = nullptr;
+  off_t file_size_ = 0;
+  // The package in the mapping, null if it isn't there as is.
+  const uint8_t *map_ = nullptr;
   off_t size_ = 0;
-  unsigned state_ = kBadBit;
-  const char *file_name_;  // For debug
+  // Set for deflated zip entries, whose bytes aren't in fd_ as such.
+  std::unique_ptr<Inflater> inflater_;
+  struct timespec mtime_ = {0, 0};
+  std::string file_name_;
+  // The file opened, file_name_ itself or the start of it.
+  std::string path_;
   std::vector<std::shared_ptr<Image>> images_;
 };
 #endif  // EMUI_EXTRACTOR_IMAGEHDR_H_
@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "crc16.h"
+#include "image.h"
+#include "pack.h"
+#include "worker_pool.h"
+
+using namespace std;
+
+// CRC tables are computed in pieces of this size so big images run in
+// parallel.
+static const size_t kCrcChunk = 64 * 1024 * 1024;
+// Chunk size when data has to be copied through user space.
+static const size_t kCopyBufSize = 8 * 1024 * 1024;
+
+namespace {
+
+// An opened input image and the header it gets in the package.
+struct PackInput {
+  int fd = -1;
+  const uint8_t *map = nullptr;
+  size_t size = 0;
+  vector<uint8_t> hdr;
+
+  Image::ImageHdr *Hdr() {
+    return reinterpret_cast<Image::ImageHdr *>(hdr.data());
+  }
+
+  ~PackInput() {
+    if (map) {
+      munmap(const_cast<uint8_t *>(map), size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+};
+
+}  // namespace
+
+static void SetField(uint8_t *field, size_t len, const string &value,
+                     uint8_t fill) {
+  memset(field, fill, len);
+  memcpy(field, value.data(), value.size() < len ? value.size() : len);
+}
+
+void InitImageHdr(const PackEntry &entry, uint64_t data_len, bool crc,
+                  vector<uint8_t> *hdr) {
+  size_t blocks =
+      crc ? (data_len + Image::kCrcBlockSize - 1) / Image::kCrcBlockSize : 0;
+  hdr->assign(Image::kHdrFixedLen + blocks * sizeof(uint16_t), 0);
+  auto *h = reinterpret_cast<Image::ImageHdr *>(hdr->data());
+  uint32_t magic = Image::kMagic;
+  memcpy(h->magic_, &magic, sizeof(magic));
+  h->hdr_len_ = hdr->size();
+  h->unused1_ = 1;
+  SetField(h->hw_id_, sizeof(h->hw_id_), entry.hw_id, 0xff);
+  h->sequence_ = entry.sequence;
+  h->data_len_ = data_len;
+  SetField(h->date_, sizeof(h->date_), entry.date, 0);
+  SetField(h->time_, sizeof(h->time_), entry.time, 0);
+  SetField(h->type_, sizeof(h->type_), entry.type, 0);
+  // Block size of the CRC table, as found in vendor packages.
+  h->unused3_ = Image::kCrcBlockSize;
+}
+
+Error ReadPackList(const string &list_fn, vector<PackEntry> *entries) {
+  FILE *fp = fopen(list_fn.c_str(), "r");
+  if (!fp) {
+    return Error(Error::kOpen, "error open " + list_fn, errno);
+  }
+  Error err;
+  char *line = nullptr;
+  size_t cap = 0;
+  unsigned line_no = 0;
+  while (err.ok() && getline(&line, &cap, fp) != -1) {
+    ++line_no;
+    istringstream is(line);
+    PackEntry e;
+    string seq;
+    if (!(is >> e.file) || e.file[0] == '#') {
+      continue;
+    }
+    if (!(is >> e.type >> seq >> e.hw_id)) {
+      err = Error(Error::kFormat,
+                  list_fn + ":" + to_string(line_no) + ": missing fields");
+      break;
+    }
+    is >> e.date >> e.time;
+    char *end;
+    e.sequence = strtoul(seq.c_str(), &end, 16);
+    if (*end) {
+      err = Error(Error::kFormat,
+                  list_fn + ":" + to_string(line_no) + ": bad sequence");
+      break;
+    }
+    // Readers print the type as a C string, so it keeps a NUL. The other
+    // fields may fill theirs.
+    const struct {
+      const char *name;
+      const string &value;
+      size_t max;
+    } fields[] = {
+        {"type", e.type, sizeof(Image::ImageHdr::type_) - 1},
+        {"hw_id", e.hw_id, sizeof(Image::ImageHdr::hw_id_)},
+        {"date", e.date, sizeof(Image::ImageHdr::date_)},
+        {"time", e.time, sizeof(Image::ImageHdr::time_)},
+    };
+    for (const auto &f : fields) {
+      if (f.value.size() > f.max) {
+        err = Error(Error::kFormat, list_fn + ":" + to_string(line_no) +
+                                        ": " + f.name + " too long");
+        break;
+      }
+    }
+    if (!err.ok()) {
+      break;
+    }
+    entries->push_back(e);
+  }
+  free(line);
+  fclose(fp);
+  return err;
+}
+
+static Error OpenInput(const PackEntry &e, PackInput *in) {
+  in->fd = open(e.file.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (in->fd == -1 || fstat(in->fd, &st) == -1) {
+    return Error(Error::kOpen, "error open " + e.file, errno);
+  }
+  if (st.st_size > UINT32_MAX) {
+    return Error(Error::kFormat, e.file + ": larger than 4 GiB");
+  }
+  in->size = st.st_size;
+  if (in->size) {
+    void *map = mmap(nullptr, in->size, PROT_READ, MAP_SHARED, in->fd, 0);
+    if (map == MAP_FAILED) {
+      return Error(Error::kRead, "error mmap " + e.file, errno);
+    }
+    in->map = static_cast<const uint8_t *>(map);
+    madvise(map, in->size, MADV_SEQUENTIAL);
+  }
+
+  InitImageHdr(e, in->size, true, &in->hdr);
+  return Error();
+}
+
+static void CrcRange(PackInput *in, size_t off, size_t len) {
+  for (size_t done = 0; done < len; done += Image::kCrcBlockSize) {
+    size_t n = len - done < Image::kCrcBlockSize ? len - done
+                                                 : Image::kCrcBlockSize;
+    uint16_t crc = Crc16(in->map + off + done, n);
+    size_t block = (off + done) / Image::kCrcBlockSize;
+    memcpy(&in->hdr[Image::kHdrFixedLen + block * sizeof(crc)], &crc,
+           sizeof(crc));
+  }
+}
+
+static bool WriteAll(int fd, const void *buf, size_t len) {
+  const uint8_t *p = static_cast<const uint8_t *>(buf);
+  while (len) {
+    ssize_t count = write(fd, p, len);
+    if (count <= 0) {
+      return false;
+    }
+    p += count;
+    len -= count;
+  }
+  return true;
+}
+
+// Appends the whole input to |fd|, in the kernel when possible.
+static bool CopyInput(const PackInput &in, int fd) {
+  loff_t off = 0;
+  while (static_cast<size_t>(off) < in.size) {
+    ssize_t count =
+        copy_file_range(in.fd, &off, fd, nullptr, in.size - off, 0);
+    if (count <= 0) {
+      if (count == 0 || (errno != EXDEV && errno != EINVAL &&
+                         errno != ENOSYS && errno != EOPNOTSUPP)) {
+        return false;
+      }
+      break;
+    }
+  }
+  while (static_cast<size_t>(off) < in.size) {
+    size_t n = in.size - off < kCopyBufSize ? in.size - off : kCopyBufSize;
+    if (!WriteAll(fd, in.map + off, n)) {
+      return false;
+    }
+    off += n;
+  }
+  return true;
+}
+
+Error PackImages(const vector<PackEntry> &entries, const string &out_fn,
+                 unsigned threads) {
+  vector<unique_ptr<PackInput>> inputs;
+  for (const auto &e : entries) {
+    inputs.emplace_back(new PackInput);
+    Error err = OpenInput(e, inputs.back().get());
+    if (!err.ok()) {
+      return err;
+    }
+  }
+
+  {
+    WorkerPool pool(threads);
+    for (const auto &in : inputs) {
+      PackInput *p = in.get();
+      for (size_t off = 0; off < p->size; off += kCrcChunk) {
+        size_t len = p->size - off < kCrcChunk ? p->size - off : kCrcChunk;
+        pool.Submit([p, off, len] { CrcRange(p, off, len); });
+      }
+    }
+    pool.Wait();
+    // The header checksum covers the finished CRC table.
+    for (const auto &in : inputs) {
+      PackInput *p = in.get();
+      pool.Submit([p] {
+        p->Hdr()->hdr_checksum_ = Crc16(p->hdr.data(), p->hdr.size());
+      });
+    }
+    pool.Wait();
+  }
+
+  int fd = open(out_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if (fd == -1) {
+    return Error(Error::kWrite, "error open " + out_fn, errno);
+  }
+  static const uint8_t kZeros[kPackPrefixLen] = {};
+  off_t pos = kPackPrefixLen;
+  bool ok = WriteAll(fd, kZeros, kPackPrefixLen);
+  for (size_t i = 0; ok && i < inputs.size(); ++i) {
+    const PackInput &in = *inputs[i];
+    off_t end = pos + in.hdr.size() + in.size;
+    off_t next = RoImageFile::Align(end);
+    ok = WriteAll(fd, in.hdr.data(), in.hdr.size()) && CopyInput(in, fd) &&
+         WriteAll(fd, kZeros, next - end);
+    if (!ok) {
+      fprintf(stderr, "error pack %s\n", entries[i].file.c_str());
+    }
+    pos = next;
+  }
+  int write_errno = ok ? 0 : errno;
+  if (close(fd) == -1 && ok) {
+    ok = false;
+    write_errno = errno;
+  }
+  if (!ok) {
+    unlink(out_fn.c_str());
+    return Error(Error::kWrite, "error write " + out_fn, write_errno);
+  }
+  return Error();
+}
@@ -0,0 +1,42 @@
+#ifndef EMUI_EXTRACTOR_PACK_H_
+#define EMUI_EXTRACTOR_PACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "error.h"
+
+// Zero bytes before the first image header, as in vendor packages.
+const size_t kPackPrefixLen = 92;
+
+// An image to put into a new UPDATE.APP, with its header fields.
+struct PackEntry {
+  std::string file;
+  std::string type;
+  uint32_t sequence = 0;
+  std::string hw_id;
+  std::string date;
+  std::string time;
+};
+
+// Parses a pack list. Each non-empty line not starting with '#' is
+//   FILE TYPE SEQUENCE(hex) HW_ID [DATE [TIME]]
+// TYPE is at most 31 characters, HW_ID 8 and DATE and TIME 16 each; longer
+// ones are an error rather than cut to fit the header.
+Error ReadPackList(const std::string &list_fn, std::vector<PackEntry> *entries);
+
+// Lays out in |hdr| the header of an image of |data_len| bytes with the
+// fields of |entry|, as vendor packages have them, and room for a CRC
+// table when |crc| is set. The table and hdr_checksum_ are left zero for
+// the caller to fill in.
+void InitImageHdr(const PackEntry &entry, uint64_t data_len, bool crc,
+                  std::vector<uint8_t> *hdr);
+
+// Writes |entries| in order as the UPDATE.APP |out_fn|. The CRC tables and
+// header checksums are computed on |threads| workers first, then the
+// package is written front to back.
+Error PackImages(const std::vector<PackEntry> &entries,
+                 const std::string &out_fn, unsigned threads);
+
+#endif  // EMUI_EXTRACTOR_PACK_H_
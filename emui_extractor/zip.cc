@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "zip.h"
+
+using namespace std;
+
+static const uint32_t kEocdSig = 0x06054b50;
+static const uint32_t kEocd64LocatorSig = 0x07064b50;
+static const uint32_t kEocd64Sig = 0x06064b50;
+static const uint32_t kCentralSig = 0x02014b50;
+static const uint32_t kLocalSig = 0x04034b50;
+static const size_t kEocdLen = 22;
+static const size_t kEocd64LocatorLen = 20;
+static const size_t kEocd64Len = 56;
+static const size_t kCentralLen = 46;
+static const size_t kLocalLen = 30;
+static const uint16_t kZip64ExtraId = 0x0001;
+
+// Deflate looks back at most this far.
+static const size_t kWindowSize = 32768;
+// Uncompressed distance between inflate checkpoints. Each one keeps a
+// window, so this trades memory for the work of reaching an offset.
+static const uint64_t kCheckpointSpan = 2 * 1024 * 1024;
+static const size_t kInflateInSize = 256 * 1024;
+
+static uint16_t Le16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t Le32(const uint8_t *p) {
+  return Le16(p) | static_cast<uint32_t>(Le16(p + 2)) << 16;
+}
+
+static uint64_t Le64(const uint8_t *p) {
+  return Le32(p) | static_cast<uint64_t>(Le32(p + 4)) << 32;
+}
+
+static bool ReadFull(int fd, uint64_t off, uint8_t *buf, size_t len) {
+  while (len) {
+    ssize_t count = pread(fd, buf, len, off);
+    if (count <= 0) {
+      if (count == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    buf += count;
+    off += count;
+    len -= count;
+  }
+  return true;
+}
+
+Error FindZipEntry(int fd, off_t size, const string &name, ZipEntry *entry) {
+  const Error bad(Error::kFormat, "not a zip archive");
+  const Error read_err(Error::kRead, "error read zip", EIO);
+
+  // The end of central directory record is followed by a comment of up to
+  // 64 KiB.
+  size_t tail_len = min<uint64_t>(size, 0xffff + kEocdLen);
+  vector<uint8_t> tail(tail_len);
+  if (!ReadFull(fd, size - tail_len, tail.data(), tail_len)) {
+    return read_err;
+  }
+  if (tail_len < kEocdLen) {
+    return bad;
+  }
+  size_t eocd = tail_len - kEocdLen + 1;
+  do {
+    --eocd;
+  } while (eocd > 0 && Le32(&tail[eocd]) != kEocdSig);
+  if (Le32(&tail[eocd]) != kEocdSig) {
+    return bad;
+  }
+  uint64_t cd_size = Le32(&tail[eocd + 12]);
+  uint64_t cd_off = Le32(&tail[eocd + 16]);
+
+  // Zip64 archives put the real values in another record, found through
+  // the locator right before the classic one.
+  uint64_t eocd_pos = size - tail_len + eocd;
+  if (eocd_pos >= kEocd64LocatorLen) {
+    uint8_t loc[kEocd64LocatorLen];
+    uint8_t rec[kEocd64Len];
+    if (!ReadFull(fd, eocd_pos - kEocd64LocatorLen, loc, sizeof(loc))) {
+      return read_err;
+    }
+    if (Le32(loc) == kEocd64LocatorSig) {
+      uint64_t rec_off = Le64(loc + 8);
+      if (rec_off + kEocd64Len > static_cast<uint64_t>(size) ||
+          !ReadFull(fd, rec_off, rec, sizeof(rec)) ||
+          Le32(rec) != kEocd64Sig) {
+        return bad;
+      }
+      cd_size = Le64(rec + 40);
+      cd_off = Le64(rec + 48);
+    }
+  }
+  if (cd_off + cd_size > static_cast<uint64_t>(size)) {
+    return bad;
+  }
+
+  vector<uint8_t> cd(cd_size);
+  if (!ReadFull(fd, cd_off, cd.data(), cd.size())) {
+    return read_err;
+  }
+  for (size_t pos = 0; pos + kCentralLen <= cd.size();) {
+    const uint8_t *h = &cd[pos];
+    if (Le32(h) != kCentralSig) {
+      return bad;
+    }
+    uint16_t name_len = Le16(h + 28);
+    uint16_t extra_len = Le16(h + 30);
+    uint16_t comment_len = Le16(h + 32);
+    size_t next = pos + kCentralLen + name_len + extra_len + comment_len;
+    if (next > cd.size()) {
+      return bad;
+    }
+    if (name_len != name.size() ||
+        memcmp(h + kCentralLen, name.data(), name_len) != 0) {
+      pos = next;
+      continue;
+    }
+
+    uint16_t flags = Le16(h + 8);
+    uint16_t method = Le16(h + 10);
+    uint64_t comp_size = Le32(h + 20);
+    uint64_t entry_size = Le32(h + 24);
+    uint64_t local_off = Le32(h + 42);
+    // Zip64 extra field: the 64 bit values of the fields that are
+    // saturated, in this order.
+    const uint8_t *extra = h + kCentralLen + name_len;
+    for (size_t e = 0; e + 4 <= extra_len;) {
+      uint16_t id = Le16(extra + e);
+      uint16_t len = Le16(extra + e + 2);
+      if (id == kZip64ExtraId) {
+        const uint8_t *v = extra + e + 4;
+        const uint8_t *end = v + min<size_t>(len, extra_len - e - 4);
+        if (entry_size == 0xffffffff && v + 8 <= end) {
+          entry_size = Le64(v);
+          v += 8;
+        }
+        if (comp_size == 0xffffffff && v + 8 <= end) {
+          comp_size = Le64(v);
+          v += 8;
+        }
+        if (local_off == 0xffffffff && v + 8 <= end) {
+          local_off = Le64(v);
+        }
+      }
+      e += 4 + len;
+    }
+    if (flags & 1) {
+      return Error(Error::kFormat, name + " is encrypted");
+    }
+    if (method != Z_DEFLATED && method != 0) {
+      return Error(Error::kFormat,
+                   name + " uses compression method " + to_string(method));
+    }
+
+    uint8_t local[kLocalLen];
+    if (!ReadFull(fd, local_off, local, sizeof(local))) {
+      return read_err;
+    }
+    if (Le32(local) != kLocalSig) {
+      return bad;
+    }
+    entry->offset = local_off + kLocalLen + Le16(local + 26) + Le16(local + 28);
+    entry->comp_size = comp_size;
+    entry->size = entry_size;
+    entry->stored = method == 0;
+    if (entry->offset + comp_size > static_cast<uint64_t>(size) ||
+        (entry->stored && comp_size != entry_size)) {
+      return bad;
+    }
+    return Error();
+  }
+  return Error(Error::kOpen, name + " not found in zip");
+}
+
+Error Inflater::Build(int fd, const ZipEntry &entry) {
+  fd_ = fd;
+  entry_ = entry;
+  checkpoints_.clear();
+  checkpoints_.push_back({0, 0, 0, {}});
+
+  z_stream strm = {};
+  if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+    return Error(Error::kFormat, "inflateInit2 failed");
+  }
+  unique_ptr<uint8_t[]> in(new uint8_t[kInflateInSize]);
+  unique_ptr<uint8_t[]> window(new uint8_t[kWindowSize]);
+  uint64_t total_in = 0;
+  uint64_t total_out = 0;
+  uint64_t read_pos = 0;
+  uint64_t last = 0;
+  int ret = Z_OK;
+  Error err;
+  // Like zlib's examples/zran.c: decode into a circular window, stopping at
+  // every deflate block boundary to see if a checkpoint is due.
+  while (ret != Z_STREAM_END) {
+    if (strm.avail_in == 0 && read_pos < entry_.comp_size) {
+      size_t n = min<uint64_t>(kInflateInSize, entry_.comp_size - read_pos);
+      if (!ReadFull(fd_, entry_.offset + read_pos, in.get(), n)) {
+        err = Error(Error::kRead, "error read zip", errno);
+        break;
+      }
+      read_pos += n;
+      strm.next_in = in.get();
+      strm.avail_in = n;
+    }
+    if (strm.avail_out == 0) {
+      strm.next_out = window.get();
+      strm.avail_out = kWindowSize;
+    }
+    total_in += strm.avail_in;
+    total_out += strm.avail_out;
+    ret = inflate(&strm, Z_BLOCK);
+    total_in -= strm.avail_in;
+    total_out -= strm.avail_out;
+    if (ret == Z_BUF_ERROR) {
+      err = Error(Error::kFormat, "deflate stream is truncated");
+      break;
+    }
+    if (ret != Z_OK && ret != Z_STREAM_END) {
+      err = Error(Error::kFormat, string("inflate: ") +
+                                      (strm.msg ? strm.msg : "bad data"));
+      break;
+    }
+    bool block_end = (strm.data_type & 128) && !(strm.data_type & 64);
+    if (ret != Z_STREAM_END && block_end &&
+        total_out - last >= kCheckpointSpan) {
+      Checkpoint cp = {total_out, total_in, strm.data_type & 7,
+                       vector<uint8_t>(kWindowSize)};
+      size_t left = strm.avail_out;
+      memcpy(cp.window.data(), window.get() + kWindowSize - left, left);
+      memcpy(cp.window.data() + left, window.get(), kWindowSize - left);
+      checkpoints_.push_back(move(cp));
+      last = total_out;
+    }
+  }
+  inflateEnd(&strm);
+  if (err.ok() && total_out != entry_.size) {
+    err = Error(Error::kFormat, "inflated size doesn't match the zip entry");
+  }
+  return err;
+}
+
+bool Inflater::Read(uint64_t off, uint8_t *buf, size_t len) const {
+  if (off + len > entry_.size) {
+    return false;
+  }
+  auto it = upper_bound(
+      checkpoints_.begin(), checkpoints_.end(), off,
+      [](uint64_t o, const Checkpoint &cp) { return o < cp.out; });
+  const Checkpoint &cp = *(it - 1);
+
+  z_stream strm = {};
+  if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+    return false;
+  }
+  bool ok = true;
+  if (cp.bits) {
+    uint8_t byte;
+    ok = ReadFull(fd_, entry_.offset + cp.in - 1, &byte, 1) &&
+         inflatePrime(&strm, cp.bits, byte >> (8 - cp.bits)) == Z_OK;
+  }
+  if (ok && !cp.window.empty()) {
+    ok = inflateSetDictionary(&strm, cp.window.data(), cp.window.size()) ==
+         Z_OK;
+  }
+
+  unique_ptr<uint8_t[]> in(new uint8_t[kInflateInSize]);
+  unique_ptr<uint8_t[]> skip_buf;
+  uint64_t read_pos = cp.in;
+  uint64_t skip = off - cp.out;
+  while (ok && (skip || len)) {
+    if (strm.avail_in == 0 && read_pos < entry_.comp_size) {
+      size_t n = min<uint64_t>(kInflateInSize, entry_.comp_size - read_pos);
+      if (!ReadFull(fd_, entry_.offset + read_pos, in.get(), n)) {
+        ok = false;
+        break;
+      }
+      read_pos += n;
+      strm.next_in = in.get();
+      strm.avail_in = n;
+    }
+    size_t want;
+    if (skip) {
+      if (!skip_buf) {
+        skip_buf.reset(new uint8_t[kWindowSize]);
+      }
+      want = min<uint64_t>(skip, kWindowSize);
+      strm.next_out = skip_buf.get();
+    } else {
+      want = min<size_t>(len, UINT32_MAX);
+      strm.next_out = buf;
+    }
+    strm.avail_out = want;
+    int ret = inflate(&strm, Z_NO_FLUSH);
+    size_t got = want - strm.avail_out;
+    if (skip) {
+      skip -= got;
+    } else {
+      buf += got;
+      len -= got;
+    }
+    // Z_BUF_ERROR means no progress was possible: the input ran out.
+    if (ret != Z_OK && !(ret == Z_STREAM_END && !skip && !len)) {
+      ok = false;
+    }
+  }
+  inflateEnd(&strm);
+  return ok;
+}
@@ -0,0 +1,47 @@
+#ifndef EMUI_EXTRACTOR_ZIP_H_
+#define EMUI_EXTRACTOR_ZIP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "error.h"
+
+// Location of a file inside a zip archive.
+struct ZipEntry {
+  // Offset of the entry data in the archive.
+  uint64_t offset = 0;
+  uint64_t comp_size = 0;
+  uint64_t size = 0;
+  // Stored entries are the file itself; the others are deflated.
+  bool stored = false;
+};
+
+// Looks up |name| in the central directory of the zip archive open on
+// |fd|, |size| bytes long. Handles zip64 archives.
+Error FindZipEntry(int fd, off_t size, const std::string &name,
+                   ZipEntry *entry);
+
+// Random access to a deflated zip entry. Build() inflates the entry once
+// and keeps the decoder state every few MiB; Read() then starts from the
+// checkpoint before the wanted bytes. Read() is const and safe to call from
+// several threads.
+class Inflater {
+ public:
+  Error Build(int fd, const ZipEntry &entry);
+  bool Read(uint64_t off, uint8_t *buf, size_t len) const;
+
+ private:
+  struct Checkpoint {
+    uint64_t out;  // Uncompressed offset.
+    uint64_t in;   // Compressed offset of the first whole byte.
+    int bits;      // Bits of the byte before |in| still to be decoded.
+    std::vector<uint8_t> window;  // The 32 KiB before |out|.
+  };
+
+  int fd_ = -1;
+  ZipEntry entry_;
+  std::vector<Checkpoint> checkpoints_;
+};
+
+#endif  // EMUI_EXTRACTOR_ZIP_H_
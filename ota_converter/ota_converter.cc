@@ -1,18 +1,31 @@
 #include <brotli/decode.h>
+#include <brotli/encode.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <linux/fs.h>
 #include <linux/loop.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -20,6 +33,21 @@ using namespace std;
 const int kBlockSize = 4096;
 const char kZeroBlock[kBlockSize] = {0};
 
+// Blocks moved per Sink::Write() call while copying new data.
+const size_t kCopyBlocks = 256;
+// Bytes of the data stream peeked to detect its codec.
+const size_t kPeekSize = 64 * 1024;
+// Out-of-order data kept in memory before spilling to a temp file.
+const size_t kReorderMemLimit = 64 * 1024 * 1024;
+// Size of one aligned write to a block device.
+const size_t kDirectBatch = 4 * 1024 * 1024;
+// Threads reading back a block device for verification.
+const unsigned kMaxVerifyThreads = 8;
+// Image bytes read per pack pipeline stage item.
+const size_t kPackChunk = 4 * 1024 * 1024;
+// Items in flight between two pack pipeline stages.
+const size_t kPackQueueDepth = 4;
+
 ////////////////// LOG //////////////////
 enum {
   LOG_FATAL,
@@ -46,13 +74,70 @@ enum {
     }                             \
   } while (0)
 
+// Progress messages go to stdout unless stdout carries the image.
+#define pr_info(...) fprintf(gInfoFile, __VA_ARGS__)
+
 #ifdef LOG_LEVEL
 static int gLogLevel = LOG_LEVEL;
 #else
 static int gLogLevel = LOG_DEFAULT;
 #endif
+static FILE *gInfoFile = stdout;
 //////////////// END LOG //////////////////
 
+static int write_full(int fd, const void *buf, size_t len) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+  while (len) {
+    ssize_t count = write(fd, p, len);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += count;
+    len -= count;
+  }
+  return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off64_t off) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+  while (len) {
+    ssize_t count = pwrite64(fd, p, len, off);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += count;
+    off += count;
+    len -= count;
+  }
+  return 0;
+}
+
+// Reads until |len| bytes or EOF. Returns bytes read or -1.
+static ssize_t read_full(int fd, void *buf, size_t len) {
+  uint8_t *p = reinterpret_cast<uint8_t *>(buf);
+  size_t total = 0;
+  while (total < len) {
+    ssize_t count = read(fd, p + total, len - total);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (count == 0) {
+      break;
+    }
+    total += count;
+  }
+  return total;
+}
+
 static int erase(int fd, vector<int> *ranges) {
   for (size_t i = 0; i < ranges->size(); i += 2) {
     size_t begin = (*ranges)[i];
@@ -61,7 +146,9 @@ static int erase(int fd, vector<int> *ranges) {
     blocks[0] = begin * kBlockSize;
     blocks[1] = (end - begin) * kBlockSize;
     if (ioctl(fd, BLKDISCARD, &blocks) == -1) {
-      pr_err("BLKDISCARD ioctl failed: %s\n", strerror(errno));
+      if (errno != EOPNOTSUPP && errno != ENOTTY) {
+        pr_err("BLKDISCARD ioctl failed: %s\n", strerror(errno));
+      }
       return -1;
     }
   }
@@ -122,33 +209,50 @@ shared_ptr<vector<int>> parse_args(string &args) {
   return ret;
 }
 
-int get_max_block(ifstream &ifs) {
-  int max_block = -1;
-  // auto saved_pos = ifs.tellg();
+struct command {
+  string cmd;
+  string args;
+  shared_ptr<vector<int>> ranges;
+};
+
+// Parses the commands following the 4 header lines of a transfer list.
+int parse_commands(ifstream &ifs, vector<command> *cmds) {
   string line;
   while (getline(ifs, line)) {
     stringstream ss(line);
-    string cmd, args;
-    ss >> cmd >> args;
+    command c;
+    ss >> c.cmd >> c.args;
     if (!ss) {
-      pr_err("Failed to parse line: %s\n", line.c_str());
-      goto out;
+      pr_err("Invalid line: %s\n", line.c_str());
+      return -1;
+    }
+    c.ranges = parse_args(c.args);
+    if (!c.ranges) {
+      pr_err("Failed to parse args: %s\n", c.args.c_str());
+      return -1;
+    }
+    for (size_t i = 0; i < c.ranges->size(); i += 2) {
+      if ((*c.ranges)[i] < 0 || (*c.ranges)[i] > (*c.ranges)[i + 1]) {
+        pr_err("Invalid range in: %s\n", c.args.c_str());
+        return -1;
+      }
     }
-    // pr_dbg("%s %s\n", cmd.c_str(), args.c_str());
+    cmds->push_back(c);
+  }
+  return 0;
+}
 
-    shared_ptr<vector<int>> ranges = parse_args(args);
-    for (auto it = ranges->begin(); it != ranges->end(); ++it) {
+// One past the last block any command touches: the size of the image in
+// blocks, 0 for one with no commands.
+int get_max_block(const vector<command> &cmds) {
+  int max_block = 0;
+  for (const auto &c : cmds) {
+    for (auto it = c.ranges->begin(); it != c.ranges->end(); ++it) {
       if (*it > max_block) {
         max_block = *it;
       }
     }
   }
-
-out:
-  // if (! ifs.seekg(saved_pos)) {
-  //     pr_err("Can't restore position\n");
-  //     max_block = -1;
-  // }
   return max_block;
 }
 
@@ -227,179 +331,1439 @@ int detech_image_loop(const char *loop_dev) {
   return 0;
 }
 
-struct cookie {
-  int dfd;
-  uint8_t in_buf[kBlockSize];
-  size_t in_available;
-  const uint8_t *next_in;
-
-  uint8_t out_buf[kBlockSize];
-  size_t out_available;
-  uint8_t *next_out;
+////////////////// SINKS //////////////////
+// Destination of the transferred blocks. Write() is called in data stream
+// order, which is not necessarily block order.
+class Sink {
+ public:
+  virtual ~Sink() {}
+  virtual int Write(size_t block, const uint8_t *data, size_t blocks) = 0;
+  virtual int Zero(vector<int> *ranges) = 0;
+  virtual int Erase(vector<int> *ranges) { return 0; }
+  virtual int Finish() { return 0; }
 };
 
-int copy_data(struct cookie *cookie, int tfd, vector<int> *ranges,
-              BrotliDecoderState *state) {
-  for (size_t i = 0; i < ranges->size(); i += 2) {
-    size_t begin = (*ranges)[i];
-    size_t end = (*ranges)[i + 1];
-    size_t size = (end - begin) * kBlockSize;
-    // pr_dbg("copy_data %ld %ld\n", begin, end);
+// Writes blocks in place into a seekable image file or loop device.
+class ImageSink : public Sink {
+ public:
+  explicit ImageSink(int fd) : fd_(fd) {}
 
-    if (lseek64(tfd, begin * kBlockSize, SEEK_SET) == -1) {
-      pr_err("Can't seek to %ld\n", begin * kBlockSize);
+  int Write(size_t block, const uint8_t *data, size_t blocks) override {
+    if (pwrite_full(fd_, data, blocks * kBlockSize, block * kBlockSize)) {
+      pr_err("Can't write data %ld %ld: %s\n", block, block * kBlockSize,
+             strerror(errno));
       return -1;
     }
+    return 0;
+  }
 
-    while (1) {
-      // For brotli compressed data.
-      if (state) {
-        if (cookie->out_available == 0) {
-          int count;
-          if ((count = write(tfd, cookie->out_buf, sizeof(cookie->out_buf))) !=
-              sizeof(cookie->out_buf)) {
-            pr_err("Can't write data %ld %ld %d/%d: %s\n", begin,
-                   begin * kBlockSize, count, kBlockSize, strerror(errno));
-            return -1;
-          }
-          cookie->next_out = cookie->out_buf;
-          cookie->out_available = sizeof(cookie->out_buf);
+  int Zero(vector<int> *ranges) override { return zeroize(fd_, ranges); }
 
-          size -= sizeof(cookie->out_buf);
-          if (size == 0) {
-            break;
-          }
+ private:
+  int fd_;
+};
+
+// Android sparse image format, see libsparse/sparse_format.h.
+struct sparse_header {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+
+struct chunk_header {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  uint32_t chunk_sz;
+  uint32_t total_sz;
+};
+
+const uint32_t kSparseMagic = 0xed26ff3a;
+const uint16_t kChunkRaw = 0xcac1;
+const uint16_t kChunkFill = 0xcac2;
+const uint16_t kChunkDontCare = 0xcac3;
+// Keeps total_sz of a raw chunk well inside 32 bits.
+const size_t kMaxChunkBlocks = 65536;
+
+// Holds data that arrives before the output cursor reaches it. Memory is
+// bounded by kReorderMemLimit; the rest is spilled to an unlinked temp file.
+class ReorderBuffer {
+ public:
+  ~ReorderBuffer() {
+    if (spill_fd_ >= 0) {
+      close(spill_fd_);
+    }
+  }
+
+  bool Empty() const { return segs_.empty(); }
+
+  int Put(size_t block, const uint8_t *data, size_t blocks) {
+    size_t len = blocks * kBlockSize;
+    // Extend the previous segment when the stream stays contiguous.
+    if (last_ != segs_.end() && last_->first + last_->second.blocks == block) {
+      segment &seg = last_->second;
+      if (seg.spill_off < 0 && mem_used_ + len <= kReorderMemLimit) {
+        seg.mem.insert(seg.mem.end(), data, data + len);
+        mem_used_ += len;
+        seg.blocks += blocks;
+        return 0;
+      }
+      if (seg.spill_off >= 0 &&
+          seg.spill_off + static_cast<off64_t>(seg.blocks * kBlockSize) ==
+              spill_end_) {
+        if (Spill(data, len) < 0) {
+          return -1;
+        }
+        seg.blocks += blocks;
+        return 0;
+      }
+    }
+    return Insert(block, data, blocks);
+  }
+
+  // Passes the segment starting at |block|, if any, to |out| and drops it.
+  template <typename F>
+  int Take(size_t block, bool *found, F out) {
+    auto it = segs_.find(block);
+    *found = it != segs_.end();
+    if (!*found) {
+      return 0;
+    }
+    segment &seg = it->second;
+    int ret = 0;
+    if (seg.spill_off < 0) {
+      ret = out(seg.mem.data(), seg.blocks);
+      mem_used_ -= seg.mem.size();
+    } else {
+      vector<uint8_t> buf(kCopyBlocks * kBlockSize);
+      size_t done = 0;
+      while (ret == 0 && done < seg.blocks) {
+        size_t n = min(kCopyBlocks, seg.blocks - done);
+        if (pread64(spill_fd_, buf.data(), n * kBlockSize,
+                    seg.spill_off + done * kBlockSize) !=
+            static_cast<ssize_t>(n * kBlockSize)) {
+          pr_err("Can't read spill file: %s\n", strerror(errno));
+          return -1;
         }
-        if (cookie->in_available == 0) {
-          cookie->in_available =
-              read(cookie->dfd, cookie->in_buf, sizeof(cookie->in_buf));
-          if (cookie->in_available < 0) {
-            if (!BrotliDecoderHasMoreOutput(state)) {
-              pr_err("Can't read data\n");
-              return -1;
-            } else {
-              cookie->in_available = 0;
-            }
+        ret = out(buf.data(), n);
+        done += n;
+      }
+    }
+    if (last_ == it) {
+      last_ = segs_.end();
+    }
+    segs_.erase(it);
+    return ret;
+  }
+
+ private:
+  struct segment {
+    size_t blocks;
+    off64_t spill_off;  // -1 when held in |mem|.
+    vector<uint8_t> mem;
+  };
+
+  int Insert(size_t block, const uint8_t *data, size_t blocks) {
+    size_t len = blocks * kBlockSize;
+    segment seg;
+    seg.blocks = blocks;
+    seg.spill_off = -1;
+    if (mem_used_ + len <= kReorderMemLimit) {
+      seg.mem.assign(data, data + len);
+      mem_used_ += len;
+    } else if ((seg.spill_off = Spill(data, len)) < 0) {
+      return -1;
+    }
+    last_ = segs_.emplace(block, move(seg)).first;
+    return 0;
+  }
+
+  off64_t Spill(const uint8_t *data, size_t len) {
+    if (spill_fd_ < 0) {
+      const char *dir = getenv("TMPDIR");
+      string tmpl = string(dir ? dir : "/tmp") + "/ota_converter.XXXXXX";
+      spill_fd_ = mkstemp(&tmpl[0]);
+      if (spill_fd_ == -1) {
+        pr_err("Can't create spill file %s: %s\n", tmpl.c_str(),
+               strerror(errno));
+        return -1;
+      }
+      unlink(tmpl.c_str());
+      pr_dbg("spilling out-of-order data to %s\n", tmpl.c_str());
+    }
+    off64_t off = spill_end_;
+    if (pwrite_full(spill_fd_, data, len, off)) {
+      pr_err("Can't write spill file: %s\n", strerror(errno));
+      return -1;
+    }
+    spill_end_ += len;
+    return off;
+  }
+
+  map<size_t, segment> segs_;
+  map<size_t, segment>::iterator last_ = segs_.end();
+  size_t mem_used_ = 0;
+  int spill_fd_ = -1;
+  off64_t spill_end_ = 0;
+};
+
+// Emits the image strictly in block order to a pipe or file, either raw or
+// as an Android sparse image. The chunk layout is planned from the whole
+// transfer list up front, so only new data has to wait for its turn.
+class StreamSink : public Sink {
+ public:
+  StreamSink(int fd, bool sparse) : fd_(fd), sparse_(sparse) {}
+
+  // Builds the chunk plan. Later commands override earlier ones, like they
+  // would on a seekable target.
+  int Plan(const vector<command> &cmds, int blocks) {
+    enum { kNone, kNew, kZero };
+    vector<uint8_t> kinds(blocks, kNone);
+    for (const auto &c : cmds) {
+      uint8_t kind = kNone;
+      if (c.cmd == "new") {
+        kind = kNew;
+      } else if (c.cmd == "zero") {
+        kind = kZero;
+      }
+      vector<int> &r = *c.ranges;
+      for (size_t i = 0; i < r.size(); i += 2) {
+        for (int b = r[i]; b < r[i + 1]; ++b) {
+          if (kind == kNew && kinds[b] == kNew) {
+            pr_err("Block %d is written twice, can't stream\n", b);
+            return -1;
           }
-          cookie->next_in = cookie->in_buf;
+          kinds[b] = kind;
         }
-        BrotliDecoderResult result = BrotliDecoderDecompressStream(
-            state, &cookie->in_available, &cookie->next_in,
-            &cookie->out_available, &cookie->next_out, nullptr);
-        if (result == BROTLI_DECODER_RESULT_ERROR) {
-          pr_err("Decompression failed with %s\n",
-                 BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state)));
+      }
+    }
+
+    static const uint16_t kTypes[] = {kChunkDontCare, kChunkRaw, kChunkFill};
+    for (size_t b = 0; b < kinds.size();) {
+      size_t e = b + 1;
+      while (e < kinds.size() && kinds[e] == kinds[b] &&
+             e - b < kMaxChunkBlocks) {
+        ++e;
+      }
+      chunks_.push_back({b, e, kTypes[kinds[b]]});
+      b = e;
+    }
+    pr_dbg("stream plan: %ld chunks\n", chunks_.size());
+
+    if (sparse_) {
+      sparse_header hdr = {kSparseMagic, 1, 0, sizeof(sparse_header),
+                           sizeof(chunk_header), kBlockSize,
+                           static_cast<uint32_t>(blocks),
+                           static_cast<uint32_t>(chunks_.size()), 0};
+      return Output(&hdr, sizeof(hdr));
+    }
+    return 0;
+  }
+
+  int Write(size_t block, const uint8_t *data, size_t blocks) override {
+    if (Pump()) {
+      return -1;
+    }
+    if (block != cursor_) {
+      return pending_.Put(block, data, blocks);
+    }
+    if (Emit(data, blocks)) {
+      return -1;
+    }
+    return Pump();
+  }
+
+  int Zero(vector<int> *ranges) override { return 0; }
+
+  int Finish() override {
+    if (Pump()) {
+      return -1;
+    }
+    if (next_ != chunks_.size() || !pending_.Empty()) {
+      pr_err("Missing data for block %ld\n", cursor_);
+      return -1;
+    }
+    return 0;
+  }
+
+ private:
+  struct chunk {
+    size_t begin;
+    size_t end;
+    uint16_t type;
+  };
+
+  int Output(const void *buf, size_t len) {
+    if (write_full(fd_, buf, len)) {
+      pr_err("Can't write output: %s\n", strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+
+  int OutputZeros(size_t blocks) {
+    while (blocks--) {
+      if (Output(kZeroBlock, sizeof(kZeroBlock))) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  // Writes raw data at the cursor, which must be inside a raw chunk.
+  int Emit(const uint8_t *data, size_t blocks) {
+    while (blocks) {
+      if (next_ == chunks_.size() || chunks_[next_].type != kChunkRaw) {
+        pr_err("Unexpected data for block %ld\n", cursor_);
+        return -1;
+      }
+      const chunk &c = chunks_[next_];
+      size_t n = min(blocks, c.end - cursor_);
+      if (Output(data, n * kBlockSize)) {
+        return -1;
+      }
+      data += n * kBlockSize;
+      blocks -= n;
+      cursor_ += n;
+      if (cursor_ == c.end) {
+        ++next_;
+        if (StartChunk()) {
           return -1;
         }
-      } else {
-        // For uncompressed data.
-        int count;
-        if ((count = read(cookie->dfd, cookie->in_buf,
-                          sizeof(cookie->in_buf))) < 0) {
-          pr_err("Can't read data\n");
+      }
+    }
+    return 0;
+  }
+
+  // Writes the header of the chunk at the cursor, once.
+  int StartChunk() {
+    if (next_ == chunks_.size() || started_ == next_) {
+      return 0;
+    }
+    started_ = next_;
+    const chunk &c = chunks_[next_];
+    if (!sparse_) {
+      return 0;
+    }
+    chunk_header hdr = {c.type, 0, static_cast<uint32_t>(c.end - c.begin),
+                        sizeof(chunk_header)};
+    if (c.type == kChunkRaw) {
+      hdr.total_sz += (c.end - c.begin) * kBlockSize;
+    } else if (c.type == kChunkFill) {
+      hdr.total_sz += sizeof(uint32_t);
+    }
+    return Output(&hdr, sizeof(hdr));
+  }
+
+  // Advances the cursor over everything that doesn't wait for new data.
+  int Pump() {
+    while (next_ < chunks_.size()) {
+      if (StartChunk()) {
+        return -1;
+      }
+      const chunk &c = chunks_[next_];
+      if (c.type == kChunkRaw) {
+        bool found;
+        if (pending_.Take(cursor_, &found, [this](const uint8_t *d, size_t n) {
+              return Emit(d, n);
+            })) {
           return -1;
         }
-        if (write(tfd, cookie->in_buf, count) != count) {
-          pr_err("Can't write data %ld %ld %d/%d: %s\n", begin,
-                 begin * kBlockSize, count, kBlockSize, strerror(errno));
-          return -1;
+        if (!found) {
+          return 0;
         }
-        size -= count;
-        if (size == 0) {
+        continue;
+      }
+
+      int ret;
+      if (sparse_) {
+        uint32_t fill = 0;
+        ret = c.type == kChunkFill ? Output(&fill, sizeof(fill)) : 0;
+      } else {
+        ret = OutputZeros(c.end - c.begin);
+      }
+      if (ret) {
+        return -1;
+      }
+      cursor_ = c.end;
+      ++next_;
+    }
+    return 0;
+  }
+
+  int fd_;
+  bool sparse_;
+  vector<chunk> chunks_;
+  size_t next_ = 0;
+  size_t started_ = -1;
+  size_t cursor_ = 0;
+  ReorderBuffer pending_;
+};
+// Checksum of the written data, compared against the read-back.
+static uint64_t checksum64(const uint8_t *p, size_t len) {
+  const uint64_t kMul = 0x9e3779b97f4a7c15ULL;
+  uint64_t h[4] = {len, kMul, ~len, ~kMul};
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    for (int j = 0; j < 4; ++j) {
+      uint64_t v;
+      memcpy(&v, p + i + j * 8, sizeof(v));
+      h[j] = (h[j] ^ v) * kMul;
+      h[j] ^= h[j] >> 31;
+    }
+  }
+  for (; i < len; ++i) {
+    h[0] = (h[0] ^ p[i]) * kMul;
+  }
+  return (h[0] ^ (h[1] >> 1)) * kMul + (h[2] ^ (h[3] << 1));
+}
+
+// Writes to a block device (or loop device) with aligned O_DIRECT writes.
+// Consecutive blocks are staged into kDirectBatch sized writes, erase
+// ranges are merged into a few large BLKDISCARDs and zero ranges use
+// BLKZEROOUT. With |verify|, every block written is checksummed on the way
+// out, and the blocks whose last write was data or zeros are read back in
+// parallel once the device is synced.
+class BlockDevSink : public Sink {
+ public:
+  BlockDevSink(int fd, const char *path, bool verify)
+      : fd_(fd), path_(path), verify_(verify) {}
+  ~BlockDevSink() { free(buf_); }
+
+  int Init() {
+    if (posix_memalign(reinterpret_cast<void **>(&buf_), kBlockSize,
+                       kDirectBatch)) {
+      pr_err("OOM\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  int Write(size_t block, const uint8_t *data, size_t blocks) override {
+    if (DiscardOverlaps(block, block + blocks) && FlushDiscards()) {
+      return -1;
+    }
+    off64_t off = static_cast<off64_t>(block) * kBlockSize;
+    size_t len = blocks * kBlockSize;
+    if (staged_len_ && off != staged_off_ + static_cast<off64_t>(staged_len_)) {
+      if (Flush()) {
+        return -1;
+      }
+    }
+    while (len) {
+      if (staged_len_ == 0) {
+        staged_off_ = off;
+      }
+      size_t n = min(len, kDirectBatch - staged_len_);
+      memcpy(buf_ + staged_len_, data, n);
+      staged_len_ += n;
+      data += n;
+      off += n;
+      len -= n;
+      if (staged_len_ == kDirectBatch && Flush()) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  int Zero(vector<int> *ranges) override {
+    if (Flush()) {
+      return -1;
+    }
+    for (size_t i = 0; i < ranges->size(); i += 2) {
+      size_t begin = (*ranges)[i];
+      size_t end = (*ranges)[i + 1];
+      if (DiscardOverlaps(begin, end) && FlushDiscards()) {
+        return -1;
+      }
+      uint64_t range[2] = {begin * kBlockSize, (end - begin) * kBlockSize};
+      if (!range[1]) {
+        continue;
+      }
+      if (ioctl(fd_, BLKZEROOUT, &range) == -1 && ZeroByWrite(range[0], range[1])) {
+        return -1;
+      }
+      if (verify_) {
+        Track(begin, end, true, nullptr);
+      }
+    }
+    return 0;
+  }
+
+  int Erase(vector<int> *ranges) override {
+    for (size_t i = 0; i < ranges->size(); i += 2) {
+      if ((*ranges)[i] < (*ranges)[i + 1]) {
+        discards_.push_back(make_pair((*ranges)[i], (*ranges)[i + 1]));
+      }
+    }
+    return 0;
+  }
+
+  int Finish() override {
+    if (Flush() || FlushDiscards()) {
+      return -1;
+    }
+    if (fsync(fd_) == -1) {
+      pr_err("Can't sync %s: %s\n", path_, strerror(errno));
+      return -1;
+    }
+    return verify_ ? Verify() : 0;
+  }
+
+ private:
+  // A run of blocks as the last write to them left it. Data runs share
+  // the block checksums of their write; |first| is that of the run's first
+  // block.
+  struct extent {
+    size_t end;
+    bool zero;
+    shared_ptr<vector<uint64_t>> sums;
+    size_t first;
+  };
+
+  // Forgets what was written to blocks [begin, end), cutting the runs that
+  // reach into it.
+  void Cut(size_t begin, size_t end) {
+    auto it = extents_.lower_bound(begin);
+    if (it != extents_.begin()) {
+      auto prev = std::prev(it);
+      if (prev->second.end > end) {
+        extent tail = prev->second;
+        tail.first += end - prev->first;
+        extents_.emplace(end, tail);
+      }
+      prev->second.end = min(prev->second.end, begin);
+    }
+    while (it != extents_.end() && it->first < end) {
+      if (it->second.end > end) {
+        extent tail = it->second;
+        tail.first += end - it->first;
+        extents_.erase(it);
+        extents_.emplace(end, tail);
+        break;
+      }
+      it = extents_.erase(it);
+    }
+  }
+
+  // Records blocks [begin, end) as written with zeros or with the data of
+  // |sums|, over whatever they held before.
+  void Track(size_t begin, size_t end, bool zero,
+             shared_ptr<vector<uint64_t>> sums) {
+    Cut(begin, end);
+    extents_.emplace(begin, extent{end, zero, move(sums), 0});
+  }
+
+  int Flush() {
+    if (!staged_len_) {
+      return 0;
+    }
+    if (pwrite_full(fd_, buf_, staged_len_, staged_off_)) {
+      pr_err("Can't write %s at 0x%lx: %s\n", path_, staged_off_,
+             strerror(errno));
+      return -1;
+    }
+    if (verify_) {
+      auto sums = make_shared<vector<uint64_t>>(staged_len_ / kBlockSize);
+      for (size_t i = 0; i < sums->size(); ++i) {
+        (*sums)[i] = checksum64(buf_ + i * kBlockSize, kBlockSize);
+      }
+      size_t begin = staged_off_ / kBlockSize;
+      size_t end = begin + sums->size();
+      Track(begin, end, false, move(sums));
+    }
+    staged_len_ = 0;
+    return 0;
+  }
+
+  int ZeroByWrite(off64_t off, size_t len) {
+    memset(buf_, 0, kDirectBatch);
+    while (len) {
+      size_t n = min(len, kDirectBatch);
+      if (pwrite_full(fd_, buf_, n, off)) {
+        pr_err("Can't zero %s at 0x%lx: %s\n", path_, off, strerror(errno));
+        return -1;
+      }
+      off += n;
+      len -= n;
+    }
+    return 0;
+  }
+
+  bool DiscardOverlaps(size_t begin, size_t end) const {
+    for (const auto &d : discards_) {
+      if (static_cast<size_t>(d.first) < end &&
+          begin < static_cast<size_t>(d.second)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Issues the pending erase ranges as few merged BLKDISCARDs.
+  int FlushDiscards() {
+    if (discards_.empty()) {
+      return 0;
+    }
+    if (Flush()) {
+      return -1;
+    }
+    sort(discards_.begin(), discards_.end());
+    vector<int> merged;
+    for (const auto &d : discards_) {
+      if (!merged.empty() && d.first <= merged.back()) {
+        merged.back() = max(merged.back(), d.second);
+      } else {
+        merged.push_back(d.first);
+        merged.push_back(d.second);
+      }
+    }
+    discards_.clear();
+    pr_dbg("discard %ld ranges\n", merged.size() / 2);
+    // Discarded blocks may read back as anything.
+    if (verify_) {
+      for (size_t i = 0; i < merged.size(); i += 2) {
+        Cut(merged[i], merged[i + 1]);
+      }
+    }
+    if (discard_ok_ && erase(fd_, &merged)) {
+      if (errno != EOPNOTSUPP && errno != ENOTTY) {
+        return -1;
+      }
+      // Erase is only a hint, carry on without it.
+      pr_dbg("%s doesn't support discard\n", path_);
+      discard_ok_ = false;
+    }
+    return 0;
+  }
+
+  // Reads every block still tracked back and compares it with its
+  // checksum, or with zeros.
+  int Verify() {
+    // Pieces of at most a batch, so a long zero range is spread over the
+    // threads too.
+    const size_t batch_blocks = kDirectBatch / kBlockSize;
+    vector<pair<size_t, extent>> checked;
+    size_t total = 0;
+    for (const auto &r : extents_) {
+      for (size_t b = r.first; b < r.second.end; b += batch_blocks) {
+        extent piece = r.second;
+        piece.end = min(r.second.end, b + batch_blocks);
+        piece.first += b - r.first;
+        checked.push_back(make_pair(b, piece));
+      }
+      total += r.second.end - r.first;
+    }
+    extents_.clear();
+
+    unsigned nr_threads = max(1u, min(thread::hardware_concurrency(),
+                                      kMaxVerifyThreads));
+    atomic<size_t> next(0);
+    atomic<size_t> bad(0);
+    atomic<bool> failed(false);
+    auto worker = [&]() {
+      int fd = open(path_, O_RDONLY | O_DIRECT);
+      if (fd == -1) {
+        fd = open(path_, O_RDONLY);
+      }
+      uint8_t *buf = nullptr;
+      if (fd == -1 ||
+          posix_memalign(reinterpret_cast<void **>(&buf), kBlockSize,
+                         kDirectBatch)) {
+        pr_err("Can't read back %s: %s\n", path_, strerror(errno));
+        failed = true;
+        if (fd != -1) {
+          close(fd);
+        }
+        return;
+      }
+      size_t i;
+      while (!failed && (i = next++) < checked.size()) {
+        size_t begin = checked[i].first;
+        const extent &e = checked[i].second;
+        off64_t off = static_cast<off64_t>(begin) * kBlockSize;
+        size_t n = (e.end - begin) * kBlockSize;
+        if (pread64(fd, buf, n, off) != static_cast<ssize_t>(n)) {
+          pr_err("Can't read back %s at 0x%lx: %s\n", path_, off,
+                 strerror(errno));
+          failed = true;
           break;
         }
+        bool match;
+        if (e.zero) {
+          match = buf[0] == 0 && memcmp(buf, buf + 1, n - 1) == 0;
+        } else {
+          match = true;
+          for (size_t b = 0; match && b < e.end - begin; ++b) {
+            match = checksum64(buf + b * kBlockSize, kBlockSize) ==
+                    (*e.sums)[e.first + b];
+          }
+        }
+        if (!match) {
+          pr_err("Verify mismatch at 0x%lx (+0x%lx)\n", off, n);
+          ++bad;
+        }
       }
+      free(buf);
+      close(fd);
+    };
+    vector<thread> threads;
+    for (unsigned i = 0; i < nr_threads; ++i) {
+      threads.emplace_back(worker);
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    if (failed || bad) {
+      pr_err("Verify failed: %ld of %ld extents\n", bad.load(),
+             checked.size());
+      return -1;
     }
+    pr_info("Verified %ld blocks in %ld extents\n", total, checked.size());
+    return 0;
   }
-  return 0;
+
+  int fd_;
+  const char *path_;
+  bool verify_;
+  uint8_t *buf_ = nullptr;
+  off64_t staged_off_ = 0;
+  size_t staged_len_ = 0;
+  vector<pair<int, int>> discards_;
+  bool discard_ok_ = true;
+  // What the device should read back, by first block of each run.
+  map<size_t, extent> extents_;
+};
+//////////////// END SINKS //////////////////
+
+struct cookie {
+  int dfd;
+  // Bytes peeked from dfd for codec detection, consumed before dfd.
+  vector<uint8_t> peek;
+  size_t peek_pos;
+
+  uint8_t in_buf[kBlockSize * 16];
+  size_t in_available;
+  const uint8_t *next_in;
+  bool in_eof;
+
+  vector<uint8_t> out_buf;
+};
+
+static ssize_t read_input(struct cookie *cookie, uint8_t *buf, size_t len) {
+  if (cookie->peek_pos < cookie->peek.size()) {
+    size_t n = min(len, cookie->peek.size() - cookie->peek_pos);
+    memcpy(buf, cookie->peek.data() + cookie->peek_pos, n);
+    cookie->peek_pos += n;
+    if (n == len) {
+      return n;
+    }
+    ssize_t count = read_full(cookie->dfd, buf + n, len - n);
+    return count < 0 ? -1 : n + count;
+  }
+  return read_full(cookie->dfd, buf, len);
 }
 
-int transfer(ifstream &ifs, const char *data_file, const char *target_dev) {
-  int ret = -1;
-  int fd = open(target_dev, O_WRONLY);
-  if (fd == -1) {
-    pr_err("Can't open %s for write\n", target_dev);
+// Brotli streams have no magic number, so try to decode the head of the
+// stream: plain block data is rejected within a few bytes, while a valid
+// brotli stream never is. Plain data can still parse as a short stream
+// followed by garbage, as a metadata block, which produces no output, or as
+// a stored meta-block, which decodes to a verbatim copy of the input.
+// Encoders don't emit the first two and, unless |trust_stored|, the last is
+// taken as uncompressed since filesystem data compresses.
+static bool detect_brotli(const vector<uint8_t> &head, bool trust_stored) {
+  BrotliDecoderState *state =
+      BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+  if (!state) {
+    return false;
+  }
+  size_t available_in = head.size();
+  const uint8_t *next_in = head.data();
+  uint8_t out[kBlockSize * 16];
+  vector<uint8_t> first;  // Head of the decoded data.
+  size_t out_len = 0;
+  BrotliDecoderResult result;
+  do {
+    size_t available_out = sizeof(out);
+    uint8_t *next_out = out;
+    result = BrotliDecoderDecompressStream(state, &available_in, &next_in,
+                                           &available_out, &next_out, nullptr);
+    out_len += sizeof(out) - available_out;
+    if (first.empty()) {
+      first.assign(out, out + min(out_len, static_cast<size_t>(kBlockSize)));
+    }
+  } while (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+  BrotliDecoderDestroyInstance(state);
+  if (result == BROTLI_DECODER_RESULT_ERROR || out_len == 0 ||
+      (result == BROTLI_DECODER_RESULT_SUCCESS && available_in)) {
+    return false;
+  }
+
+  const size_t kStoredHdrMax = 16;
+  size_t probe = first.size();
+  if (!trust_stored && probe && head.size() >= probe + kStoredHdrMax &&
+      memmem(head.data(), probe + kStoredHdrMax, first.data(), probe)) {
+    return false;
+  }
+  return true;
+}
+
+// Returns 1 if |dfd| is a regular file exactly as large as all new ranges,
+// i.e. uncompressed data, 0 for other regular files and -1 for pipes.
+static int is_raw_size(int dfd, const vector<command> &cmds) {
+  struct stat st;
+  if (fstat(dfd, &st) == -1 || !S_ISREG(st.st_mode)) {
     return -1;
   }
+  off64_t total = 0;
+  for (const auto &c : cmds) {
+    if (c.cmd != "new") {
+      continue;
+    }
+    for (size_t i = 0; i < c.ranges->size(); i += 2) {
+      total += static_cast<off64_t>((*c.ranges)[i + 1] - (*c.ranges)[i]) *
+               kBlockSize;
+    }
+  }
+  return st.st_size == total ? 1 : 0;
+}
+
+// Fills |buf| with the next |len| bytes of (decompressed) data.
+static int read_data(struct cookie *cookie, uint8_t *buf, size_t len,
+                     BrotliDecoderState *state) {
+  if (!state) {
+    // For uncompressed data.
+    ssize_t count = read_input(cookie, buf, len);
+    if (count != static_cast<ssize_t>(len)) {
+      pr_err("Can't read data: %s\n",
+             count < 0 ? strerror(errno) : "unexpected end of stream");
+      return -1;
+    }
+    return 0;
+  }
 
-  string filename(data_file);
-  bool br_compressed = true;
-  if (filename.find(".br", filename.size() - 3) == string::npos) {
-    br_compressed = false;
+  // For brotli compressed data.
+  size_t out_available = len;
+  uint8_t *next_out = buf;
+  while (out_available) {
+    if (cookie->in_available == 0 && !cookie->in_eof) {
+      ssize_t count = read_input(cookie, cookie->in_buf, sizeof(cookie->in_buf));
+      if (count < 0) {
+        pr_err("Can't read data: %s\n", strerror(errno));
+        return -1;
+      }
+      cookie->in_eof = count == 0;
+      cookie->in_available = count;
+      cookie->next_in = cookie->in_buf;
+    }
+    BrotliDecoderResult result = BrotliDecoderDecompressStream(
+        state, &cookie->in_available, &cookie->next_in, &out_available,
+        &next_out, nullptr);
+    if (result == BROTLI_DECODER_RESULT_ERROR) {
+      pr_err("Decompression failed with %s\n",
+             BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state)));
+      return -1;
+    }
+    if (out_available &&
+        (result == BROTLI_DECODER_RESULT_SUCCESS ||
+         (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT && cookie->in_eof))) {
+      pr_err("Can't read data: unexpected end of stream\n");
+      return -1;
+    }
   }
-  int dfd = open(data_file, O_RDONLY);
-  if (dfd == -1) {
+  return 0;
+}
+
+int copy_data(struct cookie *cookie, Sink *sink, vector<int> *ranges,
+              BrotliDecoderState *state) {
+  for (size_t i = 0; i < ranges->size(); i += 2) {
+    size_t begin = (*ranges)[i];
+    size_t end = (*ranges)[i + 1];
+    // pr_dbg("copy_data %ld %ld\n", begin, end);
+
+    while (begin < end) {
+      size_t blocks = min(end - begin, kCopyBlocks);
+      if (read_data(cookie, cookie->out_buf.data(), blocks * kBlockSize,
+                    state) ||
+          sink->Write(begin, cookie->out_buf.data(), blocks)) {
+        return -1;
+      }
+      begin += blocks;
+    }
+  }
+  return 0;
+}
+
+int transfer(const vector<command> &cmds, const char *data_file, Sink *sink) {
+  int ret = -1;
+  int dfd = STDIN_FILENO;
+  if (strcmp(data_file, "-") != 0 && (dfd = open(data_file, O_RDONLY)) == -1) {
     pr_err("Can't open %s for read\n", data_file);
-    close(fd);
     return -1;
   }
 
   BrotliDecoderState *state = nullptr;
   struct cookie cookie;
-  if (br_compressed) {
-    state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
-    if (!state) {
-      pr_err("Can't create brotli decoder\n");
-      close(fd);
-      close(dfd);
-      return -1;
-    }
-  }
+  int raw_size;
   cookie.dfd = dfd;
+  cookie.peek.resize(kPeekSize);
+  ssize_t peeked = read_full(dfd, cookie.peek.data(), kPeekSize);
+  if (peeked < 0) {
+    pr_err("Can't read %s: %s\n", data_file, strerror(errno));
+    goto out;
+  }
+  cookie.peek.resize(peeked);
+  cookie.peek_pos = 0;
   cookie.in_available = 0;
   cookie.next_in = cookie.in_buf;
-  cookie.out_available = sizeof(cookie.out_buf);
-  cookie.next_out = cookie.out_buf;
+  cookie.in_eof = false;
+  cookie.out_buf.resize(kCopyBlocks * kBlockSize);
 
-  string line;
-  string cmd, args;
-  while (getline(ifs, line)) {
-    stringstream ss(line);
-    ss >> cmd >> args;
-    if (!ss) {
-      pr_err("Invalid line: %s\n", line.c_str());
-      goto out;
-    }
-    auto ranges = parse_args(args);
-    if (!ranges) {
-      pr_err("Failed to parse args: %s\n", args.c_str());
+  raw_size = is_raw_size(dfd, cmds);
+  if (raw_size != 1 && detect_brotli(cookie.peek, raw_size == 0)) {
+    pr_dbg("%s: brotli compressed\n", data_file);
+    state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    if (!state) {
+      pr_err("Can't create brotli decoder\n");
       goto out;
     }
+  } else {
+    pr_dbg("%s: uncompressed\n", data_file);
+  }
 
-    if (strcmp(cmd.c_str(), "erase") == 0) {
-      pr_dbg("erase %s\n", args.c_str());
-    } else if (strcmp(cmd.c_str(), "zero") == 0) {
-      pr_dbg("zero %s\n", args.c_str());
-      if (zeroize(fd, ranges.get())) {
+  for (const auto &c : cmds) {
+    if (c.cmd == "erase") {
+      pr_dbg("erase %s\n", c.args.c_str());
+      if (sink->Erase(c.ranges.get())) {
+        pr_err("failed to erase\n");
+        goto out;
+      }
+    } else if (c.cmd == "zero") {
+      pr_dbg("zero %s\n", c.args.c_str());
+      if (sink->Zero(c.ranges.get())) {
         pr_err("failed to zeroize\n");
         goto out;
       }
-    } else if (strcmp(cmd.c_str(), "new") == 0) {
-      pr_dbg("new %s\n", args.c_str());
-      if (copy_data(&cookie, fd, ranges.get(), state)) {
+    } else if (c.cmd == "new") {
+      pr_dbg("new %s\n", c.args.c_str());
+      if (copy_data(&cookie, sink, c.ranges.get(), state)) {
         pr_err("failed to copy data\n");
         goto out;
       }
     } else {
-      pr_err("Unsupported command: %s\n", cmd.c_str());
+      pr_err("Unsupported command: %s\n", c.cmd.c_str());
       goto out;
     }
   }
 
-  ret = 0;
+  ret = sink->Finish();
 
 out:
   BrotliDecoderDestroyInstance(state);
-  close(dfd);
+  if (dfd != STDIN_FILENO) {
+    close(dfd);
+  }
+  return ret;
+}
+
+// Streams the image in block order to |image_fn|, "-" meaning stdout.
+static int transfer_stream(const vector<command> &cmds, int max_block,
+                           const char *data_file, const char *image_fn,
+                           bool sparse) {
+  int fd = STDOUT_FILENO;
+  if (strcmp(image_fn, "-") != 0 &&
+      (fd = open(image_fn, O_WRONLY | O_CREAT | O_TRUNC,
+                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+    pr_err("Can't open %s for write\n", image_fn);
+    return -1;
+  }
+
+  int ret = -1;
+  StreamSink sink(fd, sparse);
+  if (sink.Plan(cmds, max_block) == 0 &&
+      transfer(cmds, data_file, &sink) == 0) {
+    ret = 0;
+  }
+  if (fd != STDOUT_FILENO) {
+    close(fd);
+  }
+  return ret;
+}
+
+// Opens a block device target, checking that it can hold |blocks|.
+static int open_block_dev(const char *dev, int blocks) {
+  int fd = open(dev, O_WRONLY | O_DIRECT);
+  if (fd == -1 && errno == EINVAL) {
+    pr_dbg("%s: no O_DIRECT support\n", dev);
+    fd = open(dev, O_WRONLY);
+  }
+  if (fd == -1) {
+    pr_err("Can't open %s for write: %s\n", dev, strerror(errno));
+    return -1;
+  }
+  uint64_t size;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+    if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+      pr_err("Can't get size of %s: %s\n", dev, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    if (size < static_cast<uint64_t>(blocks) * kBlockSize) {
+      pr_err("%s is too small: %lu < %lu\n", dev, size,
+             static_cast<uint64_t>(blocks) * kBlockSize);
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static int transfer_block_dev(const vector<command> &cmds, int max_block,
+                              const char *data_file, const char *dev,
+                              bool verify) {
+  int fd = open_block_dev(dev, max_block);
+  if (fd == -1) {
+    return -1;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = -1;
+  BlockDevSink sink(fd, dev, verify);
+  if (sink.Init() == 0 && transfer(cmds, data_file, &sink) == 0) {
+    ret = 0;
+  }
   close(fd);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (ret == 0) {
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    pr_info("Flashed %s in %.2fs\n", dev, secs);
+  }
+  return ret;
+}
+
+static bool is_block_dev(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+////////////////// PACK //////////////////
+// Hands items from one pipeline stage to the next. Close() ends the stream:
+// Pop() drains what is left and Push() fails, which also lets a failing
+// consumer stop its producer.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t cap) : cap_(cap) {}
+
+  bool Push(T v) {
+    unique_lock<mutex> lock(mu_);
+    not_full_.wait(lock, [this] { return q_.size() < cap_ || closed_; });
+    if (closed_) {
+      return false;
+    }
+    q_.push_back(move(v));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  bool Pop(T *v) {
+    unique_lock<mutex> lock(mu_);
+    not_empty_.wait(lock, [this] { return !q_.empty() || closed_; });
+    if (q_.empty()) {
+      return false;
+    }
+    *v = move(q_.front());
+    q_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    lock_guard<mutex> lock(mu_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+  size_t cap_;
+  deque<T> q_;
+  bool closed_ = false;
+  mutex mu_;
+  condition_variable not_empty_;
+  condition_variable not_full_;
+};
+
+static bool is_zero_block_generic(const uint8_t *p) {
+  uint64_t acc = 0;
+  for (size_t i = 0; i < kBlockSize; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, sizeof(v));
+    acc |= v;
+  }
+  return acc == 0;
+}
+
+#if defined(__x86_64__)
+// Data blocks usually differ from zero early, so test 256 bytes at a time.
+__attribute__((target("avx2"))) static bool is_zero_block_avx2(
+    const uint8_t *p) {
+  for (size_t i = 0; i < kBlockSize; i += 256) {
+    const __m256i *v = reinterpret_cast<const __m256i *>(p + i);
+    __m256i acc = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(v + 2),
+                            _mm256_loadu_si256(v + 3))),
+        _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(v + 4),
+                            _mm256_loadu_si256(v + 5)),
+            _mm256_or_si256(_mm256_loadu_si256(v + 6),
+                            _mm256_loadu_si256(v + 7))));
+    if (!_mm256_testz_si256(acc, acc)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool is_zero_block_sse2(const uint8_t *p) {
+  const __m128i zero = _mm_setzero_si128();
+  for (size_t i = 0; i < kBlockSize; i += 128) {
+    const __m128i *v = reinterpret_cast<const __m128i *>(p + i);
+    __m128i acc = _mm_loadu_si128(v);
+    for (int j = 1; j < 8; ++j) {
+      acc = _mm_or_si128(acc, _mm_loadu_si128(v + j));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+typedef bool (*zero_block_fn)(const uint8_t *);
+
+static zero_block_fn pick_zero_block_fn() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return is_zero_block_avx2;
+  }
+  return is_zero_block_sse2;
+#else
+  return is_zero_block_generic;
+#endif
+}
+
+struct pack_chunk {
+  size_t block;
+  size_t blocks;
+  vector<uint8_t> data;
+};
+
+// Block ranges of one transfer list command, as [begin, end) pairs.
+class RangeList {
+ public:
+  void Add(size_t block) {
+    if (!ranges_.empty() && ranges_.back() == block) {
+      ++ranges_.back();
+    } else {
+      ranges_.push_back(block);
+      ranges_.push_back(block + 1);
+    }
+    ++blocks_;
+  }
+
+  bool Empty() const { return ranges_.empty(); }
+  size_t Blocks() const { return blocks_; }
+
+  string ToString() const {
+    string s = to_string(ranges_.size());
+    for (size_t r : ranges_) {
+      s += "," + to_string(r);
+    }
+    return s;
+  }
+
+ private:
+  vector<size_t> ranges_;
+  size_t blocks_ = 0;
+};
+
+// Reads the image in kPackChunk pieces, padding the last block with zeros.
+static bool pack_read(int fd, BoundedQueue<pack_chunk> *out, size_t *blocks) {
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  size_t block = 0;
+  bool ok = true;
+  while (true) {
+    pack_chunk chunk;
+    chunk.data.resize(kPackChunk);
+    ssize_t count = read_full(fd, chunk.data.data(), kPackChunk);
+    if (count < 0) {
+      pr_err("Can't read image: %s\n", strerror(errno));
+      ok = false;
+      break;
+    }
+    if (count == 0) {
+      break;
+    }
+    chunk.blocks = (count + kBlockSize - 1) / kBlockSize;
+    memset(chunk.data.data() + count, 0, chunk.blocks * kBlockSize - count);
+    chunk.data.resize(chunk.blocks * kBlockSize);
+    chunk.block = block;
+    block += chunk.blocks;
+    if (!out->Push(move(chunk))) {
+      break;
+    }
+    if (static_cast<size_t>(count) < kPackChunk) {
+      break;
+    }
+  }
+  *blocks = block;
+  out->Close();
+  return ok;
+}
+
+// Sorts blocks into new/zero ranges and compacts the data blocks in place.
+static void pack_scan(BoundedQueue<pack_chunk> *in,
+                      BoundedQueue<pack_chunk> *out, RangeList *new_ranges,
+                      RangeList *zero_ranges) {
+  zero_block_fn is_zero_block = pick_zero_block_fn();
+  pack_chunk chunk;
+  while (in->Pop(&chunk)) {
+    uint8_t *p = chunk.data.data();
+    size_t kept = 0;
+    for (size_t i = 0; i < chunk.blocks; ++i) {
+      const uint8_t *b = p + i * kBlockSize;
+      if (is_zero_block(b)) {
+        zero_ranges->Add(chunk.block + i);
+        continue;
+      }
+      new_ranges->Add(chunk.block + i);
+      if (kept != i) {
+        memcpy(p + kept * kBlockSize, b, kBlockSize);
+      }
+      ++kept;
+    }
+    if (!kept) {
+      continue;
+    }
+    chunk.data.resize(kept * kBlockSize);
+    if (!out->Push(move(chunk))) {
+      break;
+    }
+  }
+  in->Close();
+  out->Close();
+}
+
+static int pack_compress(BoundedQueue<pack_chunk> *in, int ofd, int quality,
+                         int window) {
+  int ret = -1;
+  BrotliEncoderState *state =
+      BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+  vector<uint8_t> out(kPackChunk);
+  pack_chunk chunk;
+  bool more = true;
+  if (!state) {
+    pr_err("Can't create brotli encoder\n");
+    goto out;
+  }
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, quality);
+  BrotliEncoderSetParameter(state, BROTLI_PARAM_LGWIN, window);
+
+  while (more) {
+    more = in->Pop(&chunk);
+    BrotliEncoderOperation op =
+        more ? BROTLI_OPERATION_PROCESS : BROTLI_OPERATION_FINISH;
+    size_t available_in = more ? chunk.data.size() : 0;
+    const uint8_t *next_in = chunk.data.data();
+    do {
+      size_t available_out = out.size();
+      uint8_t *next_out = out.data();
+      if (!BrotliEncoderCompressStream(state, op, &available_in, &next_in,
+                                       &available_out, &next_out, nullptr)) {
+        pr_err("Compression failed\n");
+        goto out;
+      }
+      if (write_full(ofd, out.data(), out.size() - available_out)) {
+        pr_err("Can't write data: %s\n", strerror(errno));
+        goto out;
+      }
+    } while (available_in || BrotliEncoderHasMoreOutput(state) ||
+             (!more && !BrotliEncoderIsFinished(state)));
+  }
+  ret = 0;
+
+out:
+  in->Close();
+  BrotliEncoderDestroyInstance(state);
   return ret;
 }
 
+// Packs a raw image into a v4 transfer list plus a brotli data stream.
+// Reading, zero-block scanning and compression run on their own threads.
+static int pack(const char *image_fn, const char *list_fn, const char *data_fn,
+                int quality, int window) {
+  int ifd = open(image_fn, O_RDONLY);
+  if (ifd == -1) {
+    pr_err("Can't open %s for read\n", image_fn);
+    return -1;
+  }
+  int ofd = STDOUT_FILENO;
+  if (strcmp(data_fn, "-") != 0 &&
+      (ofd = open(data_fn, O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+    pr_err("Can't open %s for write\n", data_fn);
+    close(ifd);
+    return -1;
+  }
+
+  BoundedQueue<pack_chunk> read_q(kPackQueueDepth);
+  BoundedQueue<pack_chunk> data_q(kPackQueueDepth);
+  RangeList new_ranges, zero_ranges;
+  size_t blocks = 0;
+  bool read_ok = true;
+  thread reader([&] { read_ok = pack_read(ifd, &read_q, &blocks); });
+  thread scanner(
+      [&] { pack_scan(&read_q, &data_q, &new_ranges, &zero_ranges); });
+  int ret = pack_compress(&data_q, ofd, quality, window);
+  scanner.join();
+  reader.join();
+  close(ifd);
+  if (ofd != STDOUT_FILENO) {
+    close(ofd);
+  }
+  if (ret || !read_ok) {
+    return -1;
+  }
+
+  ofstream ofs(list_fn);
+  ofs << 4 << "\n" << new_ranges.Blocks() << "\n0\n0\n";
+  if (!new_ranges.Empty()) {
+    ofs << "new " << new_ranges.ToString() << "\n";
+  }
+  if (!zero_ranges.Empty()) {
+    ofs << "zero " << zero_ranges.ToString() << "\n";
+  }
+  if (!ofs.flush()) {
+    pr_err("Can't write %s\n", list_fn);
+    return -1;
+  }
+  pr_info("Packed %ld blocks: %ld new, %ld zero\n", blocks,
+          new_ranges.Blocks(), zero_ranges.Blocks());
+  return 0;
+}
+
+static void pack_usage(const char *cmd) {
+  pr_err("usage: %s pack [-q quality] [-w window] image transfer.list "
+         "new.dat.br|-\n", cmd);
+  pr_err("  -q, --quality  brotli quality 0-11 (default 6)\n");
+  pr_err("  -w, --window   brotli window bits 10-24 (default 24)\n");
+}
+
+static int pack_main(int argc, char **argv) {
+  const char *cmd = argv[0];
+  int quality = 6;
+  int window = BROTLI_MAX_WINDOW_BITS;
+  struct option options[] = {
+      {"quality", required_argument, NULL, 'q'},
+      {"window", required_argument, NULL, 'w'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  optind = 2;
+  while ((c = getopt_long(argc, argv, "q:w:", options, NULL)) != -1) {
+    switch (c) {
+      case 'q':
+        quality = atoi(optarg);
+        break;
+      case 'w':
+        window = atoi(optarg);
+        break;
+      default:
+        pack_usage(cmd);
+        return 1;
+    }
+  }
+  if (argc - optind != 3 || quality < BROTLI_MIN_QUALITY ||
+      quality > BROTLI_MAX_QUALITY || window < BROTLI_MIN_WINDOW_BITS ||
+      window > BROTLI_MAX_WINDOW_BITS) {
+    pack_usage(cmd);
+    return 1;
+  }
+  if (strcmp(argv[optind + 2], "-") == 0) {
+    gInfoFile = stderr;
+  }
+  if (pack(argv[optind], argv[optind + 1], argv[optind + 2], quality,
+           window)) {
+    pr_err("Failed to pack %s\n", argv[optind]);
+    return 1;
+  }
+  return 0;
+}
+//////////////// END PACK //////////////////
+
+static void usage(const char *cmd) {
+  pr_err("usage: %s [-s] [-V] transfer.list new.dat[.br]|- image_file|-|block_dev\n",
+         cmd);
+  pr_err("  -s, --sparse  write an Android sparse image in block order\n");
+  pr_err("  -V, --verify  read the written blocks back and compare checksums\n");
+  pr_err("  \"-\" reads the data from stdin / streams the image to stdout\n");
+  pr_err("  a block device target is written in place with O_DIRECT\n");
+  pr_err("       %s pack [-q quality] [-w window] image transfer.list "
+         "new.dat.br|-\n", cmd);
+}
+
 int main(int argc, char **argv) {
   int ret = 0;
+  bool sparse = false;
+  bool verify = false;
+  const char *cmd = argv[0];
+  if (argc > 1 && strcmp(argv[1], "pack") == 0) {
+    return pack_main(argc, argv);
+  }
+  struct option options[] = {
+      {"sparse", no_argument, NULL, 's'},
+      {"verify", no_argument, NULL, 'V'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "sV", options, NULL)) != -1) {
+    switch (c) {
+      case 's':
+        sparse = true;
+        break;
+      case 'V':
+        verify = true;
+        break;
+      default:
+        usage(cmd);
+        return 1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
 
   if (argc != 4) {
-    pr_err("usage: %s transfer.list new.dat[.br] image_file\n", argv[0]);
+    usage(cmd);
+    return 1;
+  }
+  bool stream = sparse || strcmp(argv[3], "-") == 0;
+  if (strcmp(argv[3], "-") == 0) {
+    gInfoFile = stderr;
+  }
+  if (stream && verify) {
+    pr_err("--verify doesn't apply to streamed output\n");
     return 1;
   }
 
@@ -420,7 +1784,7 @@ int main(int argc, char **argv) {
     pr_err("Unsupported version: %d\n", version);
     return 1;
   }
-  printf("Version: %d\n", version);
+  pr_info("Version: %d\n", version);
 
   // second line
   string blocks_str;
@@ -428,8 +1792,10 @@ int main(int argc, char **argv) {
     pr_err("Failed to read block line\n");
     return 1;
   }
+  // Blocks written from the data stream, so 0 for an image that is all
+  // zero ranges or empty.
   int blocks = stoi(blocks_str);
-  if (blocks <= 0) {
+  if (blocks < 0) {
     pr_err("Invalid blocks: %d\n", blocks);
     return 1;
   }
@@ -441,21 +1807,31 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  int max_block = get_max_block(ifs);
+  vector<command> cmds;
+  if (parse_commands(ifs, &cmds)) {
+    return 1;
+  }
+  int max_block = get_max_block(cmds);
   if (max_block < blocks) {
     pr_err("Invalid max block: %d\n", max_block);
     return 1;
   }
-  printf("Max block: %d\n", max_block);
-  // Restore state
-  ifs.close();
-  ifs.open(argv[1]);
-  for (int i = 0; i < 4; ++i) {
-    getline(ifs, unused);
+  pr_info("Max block: %d\n", max_block);
+
+  if (stream) {
+    if (transfer_stream(cmds, max_block, argv[2], argv[3], sparse)) {
+      pr_err("Failed to transfer data\n");
+      return 1;
+    }
+    return 0;
   }
-  if (!ifs) {
-    pr_err("Can't restore file state\n");
-    return 1;
+
+  if (is_block_dev(argv[3])) {
+    if (transfer_block_dev(cmds, max_block, argv[2], argv[3], verify)) {
+      pr_err("Failed to transfer data\n");
+      return 1;
+    }
+    return 0;
   }
 
   // Create file with max block.
@@ -464,22 +1840,36 @@ int main(int argc, char **argv) {
     pr_err("Failed to create image loop device\n");
     return 1;
   }
-  printf("Create image loop device %s\n", image_loop_dev->c_str());
+  pr_info("Create image loop device %s\n", image_loop_dev->c_str());
 
   // Transfer data.
-  if (transfer(ifs, argv[2], image_loop_dev->c_str()) == -1) {
-    pr_err("Failed to transfer data\n");
-    ret = 1;
-    goto out;
+  if (verify || is_block_dev(image_loop_dev->c_str())) {
+    if (transfer_block_dev(cmds, max_block, argv[2], image_loop_dev->c_str(),
+                           verify)) {
+      pr_err("Failed to transfer data\n");
+      ret = 1;
+    }
+  } else {
+    int fd = open(image_loop_dev->c_str(), O_WRONLY);
+    if (fd == -1) {
+      pr_err("Can't open %s for write\n", image_loop_dev->c_str());
+      ret = 1;
+    } else {
+      ImageSink sink(fd);
+      if (transfer(cmds, argv[2], &sink) == -1) {
+        pr_err("Failed to transfer data\n");
+        ret = 1;
+      }
+      close(fd);
+    }
   }
 
-out:
   // Detech loop device
   if (detech_image_loop(image_loop_dev->c_str()) == -1) {
     pr_err("Failed to detech loop device: %s\n", image_loop_dev->c_str());
     ret = 1;
   } else {
-    printf("Deteched image loop device %s\n", image_loop_dev->c_str());
+    pr_info("Deteched image loop device %s\n", image_loop_dev->c_str());
   }
 
   return ret;
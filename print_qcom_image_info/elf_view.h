@@ -0,0 +1,206 @@
+#ifndef ELF_VIEW_
+#define ELF_VIEW_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sys/elf32.h"
+#include "sys/elf64.h"
+
+// A program header of either class.
+struct elf_segment {
+  uint32_t type;
+  uint64_t flags;
+  uint64_t offset;
+  uint64_t filesz;
+};
+
+// Read-only view of an image file mapped in memory. The accessors check
+// bounds and return null (or false) for anything that isn't entirely in
+// the file, so a truncated or hostile image can't make them read past the
+// mapping. The data isn't copied, but headers are copied out to aligned
+// structs, as an image embedded in a dump may start at any offset.
+class ElfView {
+ public:
+  ElfView() : data_(NULL), size_(0), map_(NULL), map_size_(0) {}
+  ~ElfView() { reset(); }
+
+  // Maps |path|. Returns -1 with errno set on failure.
+  int open(const char *path) { return open(path, 0, UINT64_MAX); }
+
+  // Maps |size| bytes at |offset| of |path|, such as an entry of an
+  // archive, or up to the end with UINT64_MAX. Returns -1 with errno set on
+  // failure, EINVAL if the range isn't in the file.
+  int open(const char *path, uint64_t offset, uint64_t size) {
+    reset();
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    uint64_t file_size = st.st_size;
+    if (size == UINT64_MAX && offset <= file_size) {
+      size = file_size - offset;
+    }
+    if (offset > file_size || size > file_size - offset) {
+      close(fd);
+      errno = EINVAL;
+      return -1;
+    }
+    if (size > 0) {
+      // mmap() wants a page aligned offset.
+      uint64_t skip = offset % sysconf(_SC_PAGESIZE);
+      void *map = mmap(NULL, skip + size, PROT_READ, MAP_PRIVATE, fd,
+                       offset - skip);
+      if (map == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+      }
+      map_ = static_cast<uint8_t *>(map);
+      map_size_ = skip + size;
+      data_ = map_ + skip;
+      size_ = size;
+    }
+    close(fd);
+    return 0;
+  }
+
+  // Views |size| bytes at |data|, such as an image embedded in a bigger
+  // view, which must outlive this one.
+  void assign(const uint8_t *data, uint64_t size) {
+    reset();
+    data_ = data;
+    size_ = size;
+  }
+
+  void reset() {
+    if (map_) {
+      munmap(map_, map_size_);
+    }
+    data_ = NULL;
+    size_ = 0;
+    map_ = NULL;
+    map_size_ = 0;
+  }
+
+  uint64_t size() const { return size_; }
+
+  const uint8_t *bytes(uint64_t off, uint64_t len) const {
+    if (off > size_ || len > size_ - off) {
+      return NULL;
+    }
+    return data_ + off;
+  }
+
+  // Copies the T at |off| to |out|.
+  template <typename T>
+  bool at(uint64_t off, T *out) const {
+    const uint8_t *p = bytes(off, sizeof(T));
+    if (!p) {
+      return false;
+    }
+    memcpy(out, p, sizeof(T));
+    return true;
+  }
+
+  bool is_elf() const {
+    const uint8_t *ident = bytes(0, EI_NIDENT);
+    return ident && ident[0] == ELFMAG0 && ident[1] == ELFMAG1 &&
+           ident[2] == ELFMAG2 && ident[3] == ELFMAG3;
+  }
+
+  // ELFCLASS32 or ELFCLASS64, 0 if it isn't an ELF of either class.
+  int elf_class() const {
+    if (!is_elf()) {
+      return 0;
+    }
+    int cls = data_[EI_CLASS];
+    if (cls == ELFCLASS32 && bytes(0, sizeof(Elf32_Ehdr))) {
+      return cls;
+    } else if (cls == ELFCLASS64 && bytes(0, sizeof(Elf64_Ehdr))) {
+      return cls;
+    }
+    return 0;
+  }
+
+  bool ehdr32(Elf32_Ehdr *ehdr) const { return at(0, ehdr); }
+  bool ehdr64(Elf64_Ehdr *ehdr) const { return at(0, ehdr); }
+
+  int phnum() const {
+    Elf32_Ehdr e32;
+    Elf64_Ehdr e64;
+    switch (elf_class()) {
+      case ELFCLASS32:
+        return ehdr32(&e32) ? e32.e_phnum : 0;
+      case ELFCLASS64:
+        return ehdr64(&e64) ? e64.e_phnum : 0;
+    }
+    return 0;
+  }
+
+  bool phdr32(int i, Elf32_Phdr *phdr) const {
+    Elf32_Ehdr ehdr;
+    if (!ehdr32(&ehdr) || i < 0 || i >= ehdr.e_phnum) {
+      return false;
+    }
+    return at(ehdr.e_phoff + static_cast<uint64_t>(i) * ehdr.e_phentsize,
+              phdr);
+  }
+
+  bool phdr64(int i, Elf64_Phdr *phdr) const {
+    Elf64_Ehdr ehdr;
+    if (!ehdr64(&ehdr) || i < 0 || i >= ehdr.e_phnum) {
+      return false;
+    }
+    return at(ehdr.e_phoff + static_cast<uint64_t>(i) * ehdr.e_phentsize,
+              phdr);
+  }
+
+  // Program header |i| of either class.
+  bool segment(int i, elf_segment *seg) const {
+    if (elf_class() == ELFCLASS32) {
+      Elf32_Phdr p;
+      if (phdr32(i, &p)) {
+        seg->type = p.p_type;
+        seg->flags = p.p_flags;
+        seg->offset = p.p_offset;
+        seg->filesz = p.p_filesz;
+        return true;
+      }
+    } else if (elf_class() == ELFCLASS64) {
+      Elf64_Phdr p;
+      if (phdr64(i, &p)) {
+        seg->type = p.p_type;
+        seg->flags = p.p_flags;
+        seg->offset = p.p_offset;
+        seg->filesz = p.p_filesz;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  ElfView(const ElfView&) = delete;
+  ElfView& operator=(const ElfView&) = delete;
+
+ private:
+  const uint8_t *data_;
+  uint64_t size_;
+  // The mapping made by open(), null for views of memory owned elsewhere.
+  uint8_t *map_;
+  uint64_t map_size_;
+};
+#endif  // ELF_VIEW_
@@ -0,0 +1,439 @@
+// Writes a synthetic signed Qualcomm ELF image, for benchmarks and tests
+// that can't use vendor images. The chain is read from a directory with
+// root.der, ca.der, att.der and the attestation key att.key, as "make
+// bench" makes them with the openssl tool.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "sys/elf32.h"
+#include "sys/elf64.h"
+
+using namespace std;
+
+static const uint32_t kPhdrFlagsHeaders = 7 << 24;
+static const uint32_t kPhdrFlagsHash = (2 << 24) | (2 << 20);
+static const uint32_t kPageSize = 0x1000;
+static const uint32_t kKeyChainSize = 0x1800;
+// The signature of the second chain, at the start of its kKeyChainSize
+// bytes.
+static const uint32_t kSecondSigSize = 256;
+// metadata_0_0 of qcert.cc, as 32 bit words.
+static const int kMetadataWords = 30;
+
+static const char *usage =
+    "Usage: gen_qcom_elf [options] OUT.ELF\n"
+    "  -c, --class 32|64   - ELF class (default: 64)\n"
+    "  -v, --version N     - hash segment header version, 3, 5 or 6\n"
+    "                        (default: 6)\n"
+    "  -p, --phdrs N       - program headers, the ELF headers, the hash\n"
+    "                        segment and N - 2 loadable segments (default: 8)\n"
+    "  -s, --seg-size N    - size of each loadable segment, with optional K/M\n"
+    "                        suffix (default: 64K)\n"
+    "  -M, --no-metadata   - leave the QTI and OEM metadata out of v6 images\n"
+    "  -d, --double        - sign twice, with a 6 certificate chain\n"
+    "  -H, --hash 256|384  - hash table and signature digest (default: 384\n"
+    "                        for v6, 256 otherwise)\n"
+    "  -k, --keys DIR      - directory of the chain (default: bench/rsa)\n"
+    "  --seed N            - seed of the segment data (default: 1)\n";
+
+static bool ParseSize(const char *s, uint64_t *size) {
+  char *end;
+  uint64_t v = strtoull(s, &end, 0);
+  switch (*end) {
+    case 'M':
+      v *= 1024;
+      // fall through
+    case 'K':
+      v *= 1024;
+      ++end;
+      break;
+  }
+  if (end == s || *end || v > UINT32_MAX) {
+    return false;
+  }
+  *size = v;
+  return true;
+}
+
+// xorshift64*, as in gen_update_app.
+static uint64_t Next(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t Align(uint32_t pos) {
+  return (pos + kPageSize - 1) / kPageSize * kPageSize;
+}
+
+static bool ReadFile(const string &path, string *data) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    fprintf(stderr, "error open %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    data->append(buf, n);
+  }
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+// The id of OU "NN HEX NAME" of the attestation cert, as qcert reads it.
+static bool CertOuId(const string &der, const char *name, uint64_t *id) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(der.data());
+  unique_ptr<X509, void (*)(X509 *)> cert(d2i_X509(NULL, &p, der.size()),
+                                          X509_free);
+  if (!cert) {
+    return false;
+  }
+  X509_NAME *subject = X509_get_subject_name(cert.get());
+  for (int i = -1; (i = X509_NAME_get_index_by_NID(
+                        subject, NID_organizationalUnitName, i)) != -1;) {
+    ASN1_STRING *ou = X509_NAME_ENTRY_get_data(X509_NAME_get_entry(subject, i));
+    string value(reinterpret_cast<const char *>(ASN1_STRING_get0_data(ou)),
+                 ASN1_STRING_length(ou));
+    unsigned index;
+    unsigned long long v;
+    char field[32];
+    if (sscanf(value.c_str(), "%x %llx %31s", &index, &v, field) == 3 &&
+        strcmp(field, name) == 0) {
+      *id = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void Digest(const EVP_MD *md, const void *data, size_t len,
+                   unsigned char *out) {
+  EVP_Digest(data, len, out, NULL, md, NULL);
+}
+
+// Signs |data| the way qcert checks it: RSA over the SW_ID/HW_ID keyed
+// double hash when the attestation cert has those OUs, ECDSA over the
+// plain digest of the curve's size.
+static bool Sign(EVP_PKEY *key, const string &att, const EVP_MD *md,
+                 const string &data, string *sig) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  size_t digest_len;
+  if (EVP_PKEY_base_id(key) == EVP_PKEY_EC) {
+    md = EVP_PKEY_bits(key) > 256 ? EVP_sha384() : EVP_sha256();
+    Digest(md, data.data(), data.size(), digest);
+    digest_len = EVP_MD_size(md);
+  } else {
+    digest_len = EVP_MD_size(md);
+    Digest(md, data.data(), data.size(), digest);
+    uint64_t sw_id, hw_id;
+    if (CertOuId(att, "SW_ID", &sw_id) && CertOuId(att, "HW_ID", &hw_id)) {
+      unsigned char buf[8 + EVP_MAX_MD_SIZE];
+      uint64_t pads[] = {sw_id ^ 0x3636363636363636ULL,
+                         hw_id ^ 0x5c5c5c5c5c5c5c5cULL};
+      for (uint64_t v : pads) {
+        for (int i = 0; i < 8; ++i) {
+          buf[i] = v >> (56 - 8 * i);
+        }
+        memcpy(buf + 8, digest, digest_len);
+        Digest(md, buf, 8 + digest_len, digest);
+      }
+    }
+  }
+
+  unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> ctx(
+      EVP_PKEY_CTX_new(key, NULL), EVP_PKEY_CTX_free);
+  // ECDSA signatures vary in length; the slot is the largest, zero padded.
+  size_t len = EVP_PKEY_size(key);
+  sig->assign(len, '\0');
+  if (!ctx || EVP_PKEY_sign_init(ctx.get()) <= 0 ||
+      EVP_PKEY_CTX_set_signature_md(ctx.get(), md) <= 0 ||
+      (EVP_PKEY_base_id(key) == EVP_PKEY_RSA &&
+       EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) <= 0) ||
+      EVP_PKEY_sign(ctx.get(), reinterpret_cast<unsigned char *>(&(*sig)[0]),
+                    &len, digest, digest_len) <= 0) {
+    fprintf(stderr, "signing failed\n");
+    return false;
+  }
+  return true;
+}
+
+template <typename T>
+static void Put(string *out, size_t off, const T &v) {
+  memcpy(&(*out)[off], &v, sizeof(v));
+}
+
+int main(int argc, char **argv) {
+  int cls = 64;
+  int version = 6;
+  unsigned phnum = 8;
+  uint64_t seg_size = 64 * 1024;
+  bool metadata = true;
+  bool double_chain = false;
+  int hash_bits = 0;
+  string keys = "bench/rsa";
+  uint64_t seed = 1;
+  struct option options[] = {
+      {"class", required_argument, NULL, 'c'},
+      {"version", required_argument, NULL, 'v'},
+      {"phdrs", required_argument, NULL, 'p'},
+      {"seg-size", required_argument, NULL, 's'},
+      {"no-metadata", no_argument, NULL, 'M'},
+      {"double", no_argument, NULL, 'd'},
+      {"hash", required_argument, NULL, 'H'},
+      {"keys", required_argument, NULL, 'k'},
+      {"seed", required_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "c:v:p:s:MdH:k:", options, NULL)) !=
+         -1) {
+    switch (c) {
+      case 'c':
+        cls = atoi(optarg);
+        break;
+      case 'v':
+        version = atoi(optarg);
+        break;
+      case 'p':
+        phnum = atoi(optarg);
+        break;
+      case 's':
+        if (!ParseSize(optarg, &seg_size)) {
+          fprintf(stderr, "bad size: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'M':
+        metadata = false;
+        break;
+      case 'd':
+        double_chain = true;
+        break;
+      case 'H':
+        hash_bits = atoi(optarg);
+        break;
+      case 'k':
+        keys = optarg;
+        break;
+      case 'S':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      default:
+        fprintf(stderr, "%s", usage);
+        return -1;
+    }
+  }
+  if (!hash_bits) {
+    hash_bits = version == 6 ? 384 : 256;
+  }
+  if (optind + 1 != argc || (cls != 32 && cls != 64) ||
+      (version != 3 && version != 5 && version != 6) || phnum < 3 ||
+      phnum > 0xffff || (hash_bits != 256 && hash_bits != 384)) {
+    fprintf(stderr, "%s", usage);
+    return -1;
+  }
+  const char *out_fn = argv[optind];
+  const EVP_MD *md = hash_bits == 384 ? EVP_sha384() : EVP_sha256();
+  size_t md_len = EVP_MD_size(md);
+
+  string certs[3];
+  const char *cert_names[] = {"att.der", "ca.der", "root.der"};
+  for (int i = 0; i < 3; ++i) {
+    if (!ReadFile(keys + "/" + cert_names[i], &certs[i])) {
+      return -1;
+    }
+  }
+  string chain = certs[0] + certs[1] + certs[2];
+  if (chain.size() > kKeyChainSize - kSecondSigSize) {
+    fprintf(stderr, "certificates don't fit in a chain\n");
+    return -1;
+  }
+  FILE *key_fp = fopen((keys + "/att.key").c_str(), "r");
+  if (!key_fp) {
+    fprintf(stderr, "error open %s/att.key: %s\n", keys.c_str(),
+            strerror(errno));
+    return -1;
+  }
+  unique_ptr<EVP_PKEY, void (*)(EVP_PKEY *)> key(
+      PEM_read_PrivateKey(key_fp, NULL, NULL, NULL), EVP_PKEY_free);
+  fclose(key_fp);
+  if (!key) {
+    fprintf(stderr, "bad key %s/att.key\n", keys.c_str());
+    return -1;
+  }
+
+  // Layout: the ELF and program headers, the hash segment on the next page
+  // and each loadable segment on a page of its own.
+  size_t ehdr_size = cls == 64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+  size_t phdr_size = cls == 64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+  uint32_t headers_size = ehdr_size + phnum * phdr_size;
+
+  uint32_t hdr_size = version == 6 ? 48 : 40;
+  uint32_t md_size = version == 6 && metadata ? kMetadataWords * 4 : 0;
+  uint32_t code_size = phnum * md_len;
+  uint32_t sig_size = EVP_PKEY_size(key.get());
+  uint32_t chain_size = kKeyChainSize * (double_chain ? 2 : 1);
+  uint32_t hash_off = Align(headers_size);
+  uint32_t hash_size =
+      hdr_size + 2 * md_size + code_size + sig_size + chain_size;
+
+  vector<uint32_t> offsets(phnum);
+  vector<uint32_t> sizes(phnum);
+  vector<uint32_t> flags(phnum, 5);
+  offsets[0] = 0;
+  sizes[0] = headers_size;
+  flags[0] = kPhdrFlagsHeaders;
+  offsets[1] = hash_off;
+  sizes[1] = hash_size;
+  flags[1] = kPhdrFlagsHash;
+  uint64_t end = Align(hash_off + hash_size);
+  for (unsigned i = 2; i < phnum; ++i) {
+    offsets[i] = end;
+    sizes[i] = seg_size;
+    end = Align(end + seg_size);
+    if (end > UINT32_MAX) {
+      fprintf(stderr, "image too big\n");
+      return -1;
+    }
+  }
+  string out(end, '\0');
+
+  if (cls == 64) {
+    Elf64_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_AARCH64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = ehdr_size;
+    ehdr.e_ehsize = ehdr_size;
+    ehdr.e_phentsize = phdr_size;
+    ehdr.e_phnum = phnum;
+    Put(&out, 0, ehdr);
+    for (unsigned i = 0; i < phnum; ++i) {
+      Elf64_Phdr phdr = {};
+      phdr.p_type = i < 2 ? PT_NULL : PT_LOAD;
+      phdr.p_flags = flags[i];
+      phdr.p_offset = offsets[i];
+      phdr.p_vaddr = phdr.p_paddr = i < 2 ? 0 : offsets[i];
+      phdr.p_filesz = phdr.p_memsz = sizes[i];
+      phdr.p_align = kPageSize;
+      Put(&out, ehdr_size + i * phdr_size, phdr);
+    }
+  } else {
+    Elf32_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_ARM;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = ehdr_size;
+    ehdr.e_ehsize = ehdr_size;
+    ehdr.e_phentsize = phdr_size;
+    ehdr.e_phnum = phnum;
+    Put(&out, 0, ehdr);
+    for (unsigned i = 0; i < phnum; ++i) {
+      Elf32_Phdr phdr = {};
+      phdr.p_type = i < 2 ? PT_NULL : PT_LOAD;
+      phdr.p_flags = flags[i];
+      phdr.p_offset = offsets[i];
+      phdr.p_vaddr = phdr.p_paddr = i < 2 ? 0 : offsets[i];
+      phdr.p_filesz = phdr.p_memsz = sizes[i];
+      phdr.p_align = kPageSize;
+      Put(&out, ehdr_size + i * phdr_size, phdr);
+    }
+  }
+  uint64_t state = (seed + 1) * 0x9e3779b97f4a7c15ULL | 1;
+  for (unsigned i = 2; i < phnum; ++i) {
+    for (uint32_t off = 0; off < sizes[i]; off += 8) {
+      uint64_t v = Next(&state);
+      memcpy(&out[offsets[i] + off], &v, min<uint32_t>(8, sizes[i] - off));
+    }
+  }
+
+  // The hash segment: header, metadata, hash table, signature, chains.
+  string seg(hash_size, '\xff');
+  uint32_t hdr[12] = {0, static_cast<uint32_t>(version), 0, 0,
+                      hash_size - hdr_size, code_size, 0, sig_size, 0,
+                      chain_size, md_size, md_size};
+  memcpy(&seg[0], hdr, hdr_size);
+  uint32_t pos = hdr_size;
+  // The IDs of the attestation cert's OUs, or those the bench chains use
+  // for certs without them, as v6 images have.
+  uint64_t sw_id = 0x19;
+  uint64_t hw_id = 0x009600E100000000ULL;
+  CertOuId(certs[0], "SW_ID", &sw_id);
+  CertOuId(certs[0], "HW_ID", &hw_id);
+  for (uint32_t m = 0; m < 2 * md_size; m += md_size) {
+    uint32_t words[kMetadataWords] = {};
+    words[2] = sw_id;
+    words[3] = hw_id >> 32;
+    words[7] = 1 << 8;  // debug
+    words[kMetadataWords - 1] = 1;  // anti_rollback_version
+    memcpy(&seg[pos], words, sizeof(words));
+    pos += md_size;
+  }
+  for (unsigned i = 0; i < phnum; ++i) {
+    unsigned char digest[EVP_MAX_MD_SIZE] = {};
+    // The hash segment's own entry stays zero.
+    if (i != 1) {
+      Digest(md, &out[offsets[i]], sizes[i], digest);
+    }
+    memcpy(&seg[pos + i * md_len], digest, md_len);
+  }
+  pos += code_size;
+  string signed_data = seg.substr(0, pos);
+  string sig;
+  if (!Sign(key.get(), certs[0], md, signed_data, &sig)) {
+    return -1;
+  }
+  memcpy(&seg[pos], sig.data(), sig.size());
+  pos += sig_size;
+  memcpy(&seg[pos], chain.data(), chain.size());
+  if (double_chain) {
+    pos += kKeyChainSize;
+    if (!Sign(key.get(), certs[0], md, signed_data, &sig) ||
+        sig.size() > kSecondSigSize) {
+      return -1;
+    }
+    sig.resize(kSecondSigSize, '\0');
+    memcpy(&seg[pos], sig.data(), sig.size());
+    memcpy(&seg[pos + kSecondSigSize], chain.data(), chain.size());
+  }
+  memcpy(&out[hash_off], seg.data(), seg.size());
+
+  int fd = open(out_fn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if (fd == -1) {
+    fprintf(stderr, "error open %s: %s\n", out_fn, strerror(errno));
+    return -1;
+  }
+  if (write(fd, out.data(), out.size()) != static_cast<ssize_t>(out.size()) ||
+      close(fd) == -1) {
+    fprintf(stderr, "error write %s: %s\n", out_fn, strerror(errno));
+    unlink(out_fn);
+    return -1;
+  }
+  return 0;
+}
@@ -1,17 +1,34 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <getopt.h>
+#include <limits.h>
 #include <openssl/bio.h>
+#include <openssl/bn.h>
 #include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
+#include "elf_view.h"
+#include "file_range.h"
 #include "scoped_fd.h"
 #include "sys/elf32.h"
 #include "sys/elf64.h"
@@ -79,6 +96,70 @@ struct metadata_0_0 {
   uint32_t anti_rollback_version;
 };
 
+struct cert_info {
+  string der;
+  string subject;
+  string issuer;
+  string sha1;
+  vector<string> ous;
+};
+
+// Outcome of checking one attestation signature and its chain.
+struct sig_result {
+  string scheme;
+  bool signature_ok = false;
+  bool chain_ok = false;
+  string chain_error;
+};
+
+// What qcert found in one image.
+struct image_info {
+  string path;
+  // Where the image is in the file, for those found by --scan.
+  uint64_t elf_off = 0;
+  uint64_t elf_size = 0;
+  // Set if parsing stopped early.
+  string error;
+  uint32_t hash_off = 0;
+  uint32_t hash_sz = 0;
+  // The v6 fields stay 0 for older versions.
+  mi_boot_image_header_type_v6 header = {};
+  bool has_qti_md = false;
+  bool has_oem_md = false;
+  metadata_0_0 qti_md;
+  metadata_0_0 oem_md;
+  // Offset of the hash table in the hash segment.
+  uint32_t table_off = 0;
+  vector<cert_info> certs;
+
+  // Filled by verify_hashes().
+  string hash_alg;
+  vector<int> seg_status;
+  // Filled by verify_signatures(), one per certificate chain.
+  vector<sig_result> sigs;
+};
+
+// Outcome of checking a segment against its hash table entry.
+enum {
+  kSegOk,
+  kSegMismatch,
+  kSegNotHashed,  // The entry is all zeros, as for the hash segment itself.
+  kSegOutOfFile,  // The segment doesn't fit in the file.
+};
+
+static const char *seg_status_str(int status) {
+  switch (status) {
+    case kSegOk:
+      return "ok";
+    case kSegMismatch:
+      return "mismatch";
+    case kSegNotHashed:
+      return "not hashed";
+    default:
+      return "out of file";
+  }
+}
+
 static char byte2char(int b) {
   if (0 <= b && b <= 9) {
     return b + '0';
@@ -121,8 +202,115 @@ static string parse_cert_sn(X509 *cert) {
   return sn;
 }
 
-static int print_certs(shared_ptr<char> data, uint32_t sz, const char *fn=NULL) {
-  const unsigned char *p = reinterpret_cast<const unsigned char *>(data.get());
+static int fail(image_info *info, const string &msg) {
+  info->error = msg;
+  return -1;
+}
+
+// Certificates parsed so far, keyed by SHA1 and without their DER. The
+// same few certificates sign most of a firmware tree, and --index keeps
+// them across runs.
+static mutex cert_cache_lock;
+static map<string, cert_info> cert_cache;
+
+// Size of the DER SEQUENCE at |p|, header included; 0 if it isn't one or
+// doesn't fit in |len|.
+static size_t der_size(const unsigned char *p, size_t len) {
+  if (len < 2 || p[0] != 0x30) {
+    return 0;
+  }
+  size_t hdr = 2;
+  size_t body = p[1];
+  if (body & 0x80) {
+    size_t n = body & 0x7f;
+    if (n == 0 || n > 4 || len < 2 + n) {
+      return 0;
+    }
+    body = 0;
+    for (size_t i = 0; i < n; ++i) {
+      body = body << 8 | p[2 + i];
+    }
+    hdr += n;
+  }
+  return body <= len - hdr ? hdr + body : 0;
+}
+
+static string sha1_hex(const unsigned char *p, size_t len) {
+  unsigned char buf[kSha1Sz];
+  unsigned n;
+  if (!EVP_Digest(p, len, buf, &n, EVP_sha1(), NULL) || n != kSha1Sz) {
+    return "";
+  }
+  return hex_encode(reinterpret_cast<const char *>(buf), n);
+}
+
+// Parses the cert at |p| into |ci|, and moves |p| past it.
+static int parse_cert(const unsigned char *&p, uint32_t sz, cert_info *ci,
+                      image_info *info) {
+  const unsigned char *s = p;
+  // A cert seen before is found by the SHA1 of its DER, no parsing needed.
+  size_t len = der_size(p, sz);
+  string sha1 = len ? sha1_hex(p, len) : "";
+  if (!sha1.empty()) {
+    lock_guard<mutex> lock(cert_cache_lock);
+    auto it = cert_cache.find(sha1);
+    if (it != cert_cache.end()) {
+      *ci = it->second;
+      ci->der.assign(reinterpret_cast<const char *>(s), len);
+      p += len;
+      return 0;
+    }
+  }
+
+  unique_ptr<X509, void (*)(X509 *)> cert(d2i_X509(NULL, &p, sz), X509_free);
+  if (!cert) {
+    return fail(info, "Unable to parse cert");
+  }
+  char *subj = X509_NAME_oneline(X509_get_subject_name(cert.get()), NULL, 0);
+  if (!subj) {
+    return fail(info, "Unable to get subject");
+  }
+  char *issuer = X509_NAME_oneline(X509_get_issuer_name(cert.get()), NULL, 0);
+  if (!issuer) {
+    OPENSSL_free(subj);
+    return fail(info, "Unable to get issuer");
+  }
+  ci->subject = subj;
+  ci->issuer = issuer;
+  OPENSSL_free(issuer);
+  const EVP_MD *digest = EVP_sha1();
+  unsigned n;
+  char buf[kSha1Sz];
+  int rc = X509_digest(cert.get(), digest, (unsigned char*) buf, &n);
+  if (rc == 0 || n != kSha1Sz) {
+    OPENSSL_free(subj);
+    return fail(info, "Unable to get sha1 of cert");
+  }
+  ci->sha1 = hex_encode(buf, n);
+
+  char *rest = subj;
+  char *token;
+  while ((token = strsep(&rest, "/")) != NULL) {
+    if (token[0] == '\0') {
+      continue;
+    }
+    if (strncmp(token, "OU", 2) == 0) {
+      ci->ous.push_back(token);
+    }
+  }
+  sort(ci->ous.begin(), ci->ous.end());
+  OPENSSL_free(subj);
+
+  lock_guard<mutex> lock(cert_cache_lock);
+  cert_cache[ci->sha1] = *ci;
+  cert_cache[ci->sha1].der.clear();
+  ci->der.assign(reinterpret_cast<const char *>(s), p - s);
+  return 0;
+}
+
+static int parse_certs(const unsigned char *data, uint32_t sz,
+                       image_info *info) {
+  const unsigned char *p = data;
   const unsigned char *end = p + sz;
   int i = 0;
   int nr_certs;
@@ -132,8 +320,7 @@ static int print_certs(shared_ptr<char> data, uint32_t sz, const char *fn=NULL)
   } else if (sz == kKeyChainSize * 2) {
     nr_certs = kMaxCerts * 2;
   } else {
-    fprintf(stderr, "Invalid cert size %d\n", sz);
-    return -1;
+    return fail(info, "Invalid cert size " + to_string(sz));
   }
   while (p < end && i < nr_certs) {
     ++i;
@@ -143,216 +330,521 @@ static int print_certs(shared_ptr<char> data, uint32_t sz, const char *fn=NULL)
       // TODO: Skip signature. How to know size of signature.
       p += 256;
     }
-    const unsigned char *s = p;
-    unique_ptr<X509, void (*)(X509 *)> cert(d2i_X509(NULL, &p, sz), X509_free);
-    if (!cert) {
-      fprintf(stderr, "Unable to parse cert\n");
+    cert_info ci;
+    if (parse_cert(p, sz, &ci, info) == -1) {
       return -1;
     }
     sz = end - p;
+    info->certs.push_back(ci);
+  }
 
-    if (fn) {
-      string fni = fn + to_string(i) + ".cert";
-      DBG("write cert to %s\n", fni.c_str());
-      int fd = open(fni.c_str(), O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-      if (fd == -1) {
-        perror("open");
-        return -1;
-      }
-      if (write(fd, s, p - s) != p - s) {
-        perror("write");
-        close(fd);
-        return -1;
-      }
-      close(fd);
-      continue;
-    }
+  return 0;
+}
 
-    char *subj = X509_NAME_oneline(X509_get_subject_name(cert.get()), NULL, 0);
-    if (!subj) {
-      fprintf(stderr, "Unable to get subject\n");
-      return -1;
-    }
-    char *issuer = X509_NAME_oneline(X509_get_issuer_name(cert.get()), NULL, 0);
-    if (!issuer) {
-      fprintf(stderr, "Unable to get subject\n");
-      OPENSSL_free(subj);
-      return -1;
-    }
-    const EVP_MD *digest = EVP_sha1();
-    unsigned len;
-    char buf[kSha1Sz];
-    int rc = X509_digest(cert.get(), digest, (unsigned char*) buf, &len);
-    if (rc == 0 || len != kSha1Sz) {
-      fprintf(stderr, "Unable to get sha1 of cert\n");
-      return -1;
-    }
-    string sha1 = hex_encode(buf, len);
-    string sn = parse_cert_sn(cert.get());
+static void usage(const char *cmd) {
+  fprintf(stderr,
+          "%s [-d] [-V] [--json] img\n"
+          "%s [-j jobs] [-V] --recursive dir\n"
+          "%s [-j jobs] --index file --recursive dir\n"
+          "%s --index file --query key=value[,...]\n"
+          "%s [-j jobs] [-V] --scan file\n"
+          "  img and file may also be part of a file: a stored zip entry\n"
+          "  (fw.zip!abl.elf), an UPDATE.APP image (UPDATE.APP!ABL.img, also\n"
+          "  fw.zip!UPDATE.APP!ABL.img) or a byte range (dump.bin@0x3000+0x50000)\n"
+          "  -d, --dump          write the certificates to img1.cert, ...\n"
+          "  --json              print a JSON record instead of text\n"
+          "  -r, --recursive     print a JSON record per line for each ELF\n"
+          "                      file under dir, in path order\n"
+          "  -V, --verify        check the segments against the hash table,\n"
+          "                      the signatures and the cert chains\n"
+          "  -j, --jobs          number of threads (default: CPU count)\n"
+          "  -i, --index         with --recursive, update the cert index file\n"
+          "                      from dir instead, parsing only new and\n"
+          "                      changed files\n"
+          "  -q, --query         print the indexed images with a cert chain\n"
+          "                      matching all the terms; keys are root and\n"
+          "                      cert (SHA1), and sw_id, hw_id, oem_id and\n"
+          "                      model_id (hex, from the metadata of v6\n"
+          "                      images, else the attestation cert)\n"
+          "  -s, --scan          print a JSON record per signed ELF found in\n"
+          "                      file, a raw dump or blob, with its offset\n",
+          cmd, cmd, cmd, cmd, cmd);
+  exit(-1);
+}
 
-    printf("[*] Cert %d:\n", i);
-    printf("  Subject: %s\n", subj);
-    printf("  Issuer : %s\n", issuer);
-    printf("  Sha1   : %s\n", sha1.c_str());
-    // printf("  SN     : %s\n", sn.c_str());
+static int find_hash_segment(const ElfView &view, image_info *info) {
+  if (!view.is_elf()) {
+    return fail(info, "Not elf format");
+  }
+  if (!view.elf_class()) {
+    return fail(info, "Invalid elf format");
+  }
 
-    vector<char *> ous;
-    char *token;
-    while ((token = strsep(&subj, "/")) != NULL) {
-      if (token[0] == '\0') {
-        continue;
-      }
-      if (strncmp(token, "OU", 2) == 0) {
-        ous.push_back(token);
-      }
+  elf_segment seg;
+  for (int i = 0; i < view.phnum(); ++i) {
+    if (!view.segment(i, &seg)) {
+      return fail(info, "Truncated program headers");
     }
-    sort(ous.begin(), ous.end(),
-         [](char *a, char *b) { return strcmp(a, b) < 0; });
-    for (auto it = ous.cbegin(); it != ous.cend(); ++it) {
-      printf("  %s\n", *it);
+    if ((seg.flags & kElfPhdrTypeMask) == kElfPhdrTypeHash) {
+      if (!view.bytes(seg.offset, seg.filesz)) {
+        return fail(info, "Truncated hash segment");
+      }
+      info->hash_off = seg.offset;
+      info->hash_sz = seg.filesz;
+      return 0;
     }
-    OPENSSL_free(subj);
-    OPENSSL_free(issuer);
   }
+  return fail(info, "Can't find hash segment");
+}
 
-  return 0;
+// Returns the |len| bytes at |off| of the hash segment, null if they are
+// outside of it.
+static const uint8_t *hash_seg_bytes(const ElfView &view,
+                                     const image_info *info, uint64_t off,
+                                     uint64_t len) {
+  if (off > info->hash_sz || len > info->hash_sz - off) {
+    return NULL;
+  }
+  return view.bytes(info->hash_off + off, len);
 }
 
-static int read_file(int fd, uint32_t off, uint32_t len, void *buf) {
-  if (lseek(fd, off, SEEK_SET) == -1) {
-    perror("lseek");
-    return -1;
+static int parse_metadata(const ElfView &view, uint32_t off, uint32_t sz,
+                          const char *type, metadata_0_0 *meta,
+                          image_info *info) {
+  const uint8_t *p = hash_seg_bytes(view, info, off, sz);
+  if (sz <= sizeof(metadata_base) || !p) {
+    return fail(info, string("invalid ") + type + " metadata");
   }
-  if (read(fd, buf, len) != len) {
-    perror("read");
-    return -1;
+
+  // The hash segment of an image in a dump may be unaligned.
+  metadata_base meta_base;
+  memcpy(&meta_base, p, sizeof(meta_base));
+  if (meta_base.major != 0 || meta_base.minor != 0) {
+    return fail(info, "unsupported version: " + to_string(meta_base.major) +
+                          "." + to_string(meta_base.minor));
   }
+
+  // Only support 0.0 now.
+  if (sz != sizeof(metadata_0_0)) {
+    return fail(info, "invalid metadata version 0.0");
+  }
+  memcpy(meta, p, sizeof(*meta));
   return 0;
 }
 
-static int elf32_find_hashseg(int fd, uint32_t &offset, uint32_t &size) {
-  Elf32_Ehdr ehdr;
-  if (read(fd, &ehdr, sizeof(ehdr)) != sizeof(ehdr)) {
-    perror("read");
+// Parses the hash segment header, the metadata and the certificates of
+// the image in |view|. On failure |info| has what was found so far and
+// the error.
+static int parse_image(const ElfView &view, image_info *info) {
+  if (find_hash_segment(view, info) == -1) {
     return -1;
   }
+  DBG("hash segment: %x %x\n", info->hash_off, info->hash_sz);
 
-  Elf32_Phdr phdr;
-  for (int i = 0; i < ehdr.e_phnum; ++i) {
-    uint32_t poff = ehdr.e_phoff + i * ehdr.e_phentsize;
-    if (read_file(fd, poff, sizeof(phdr), &phdr) == -1) {
-      return -1;
-    }
+  mi_boot_image_header_type_v6 &header = info->header;
+  const uint8_t *p = hash_seg_bytes(view, info, 0, kHashSegHeaderSz);
+  if (!p) {
+    return fail(info, "Truncated hash segment header");
+  }
+  memcpy(&header.base, p, kHashSegHeaderSz);
 
-    if ((phdr.p_flags & kElfPhdrTypeMask) == kElfPhdrTypeHash) {
-      offset = phdr.p_offset;
-      size = phdr.p_filesz;
-      return 0;
+  uint32_t cert_off;
+  if (header.base.version > kMbnV6) {
+    return fail(info,
+                "Unsupported mbn version " + to_string(header.base.version));
+  } else if (header.base.version == kMbnV6) {
+    DBG("V6 header\n");
+    p = hash_seg_bytes(view, info, 0, kHashSegHeaderSzV6);
+    if (!p) {
+      return fail(info, "Truncated hash segment header");
     }
+    memcpy(&header, p, kHashSegHeaderSzV6);
+    uint32_t qti_md_off = sizeof(mi_boot_image_header_type_v6);
+    if (header.qti_md_size) {
+      info->has_qti_md = true;
+      if (parse_metadata(view, qti_md_off, header.qti_md_size, "QTI",
+                         &info->qti_md, info) == -1) {
+        return -1;
+      }
+    }
+    if (header.md_size) {
+      info->has_oem_md = true;
+      if (parse_metadata(view, qti_md_off + header.qti_md_size,
+                         header.md_size, "OEM", &info->oem_md, info) == -1) {
+        return -1;
+      }
+    }
+    info->table_off = sizeof(mi_boot_image_header_type_v6) +
+                      header.qti_md_size + header.md_size;
+  } else {
+    info->table_off = sizeof(mi_boot_image_header_type);
   }
+  cert_off = info->table_off + header.base.code_size +
+             header.base.signature_size;
+  DBG("cert: %x %x\n", cert_off, header.base.cert_chain_size);
 
-  return -1;
+  uint32_t cert_sz = header.base.cert_chain_size;
+  p = hash_seg_bytes(view, info, cert_off, cert_sz);
+  if (!p) {
+    return fail(info, "Truncated cert chain");
+  }
+  return parse_certs(p, cert_sz, info);
 }
 
-static int elf64_find_hashseg(int fd, uint32_t &offset, uint32_t &size) {
-  Elf64_Ehdr ehdr;
-  if (read(fd, &ehdr, sizeof(ehdr)) != sizeof(ehdr)) {
-    perror("read");
-    return -1;
+static const char *md_name(const EVP_MD *md) {
+  return EVP_MD_size(md) == 48 ? "sha384" : "sha256";
+}
+
+// There is one hash table entry per program header, so the entry size
+// tells SHA-256 from SHA-384. Null if it's neither.
+static const EVP_MD *table_md(const ElfView &view, const image_info &info) {
+  int phnum = view.phnum();
+  uint32_t code_size = info.header.base.code_size;
+  if (phnum == 0 || code_size % phnum) {
+    return NULL;
+  }
+  switch (code_size / phnum) {
+    case 32:
+      return EVP_sha256();
+    case 48:
+      return EVP_sha384();
+  }
+  return NULL;
+}
+
+// Checks every segment against its hash table entry, on |jobs| threads.
+// Returns -1 if the table can't be used at all.
+static int verify_hashes(const ElfView &view, image_info *info,
+                         unsigned jobs) {
+  int phnum = view.phnum();
+  uint32_t code_size = info->header.base.code_size;
+  const EVP_MD *md = table_md(view, *info);
+  if (!md) {
+    return fail(info, "Unknown hash table layout, " + to_string(code_size) +
+                          " bytes for " + to_string(phnum) + " segments");
+  }
+  info->hash_alg = md_name(md);
+  size_t md_len = code_size / phnum;
+  const uint8_t *table = hash_seg_bytes(view, info, info->table_off,
+                                        code_size);
+  if (!table) {
+    return fail(info, "Truncated hash table");
   }
 
-  Elf64_Phdr phdr;
-  for (int i = 0; i < ehdr.e_phnum; ++i) {
-    uint32_t poff = ehdr.e_phoff + i * ehdr.e_phentsize;
-    if (read_file(fd, poff, sizeof(phdr), &phdr) == -1) {
-      return -1;
+  // The biggest segments go first, so they don't end up last on one
+  // thread.
+  vector<pair<uint64_t, int>> order;
+  vector<elf_segment> segs(phnum);
+  info->seg_status.assign(phnum, kSegNotHashed);
+  static const uint8_t kZeros[EVP_MAX_MD_SIZE] = {};
+  for (int i = 0; i < phnum; ++i) {
+    view.segment(i, &segs[i]);
+    if (memcmp(table + i * md_len, kZeros, md_len) != 0) {
+      order.push_back(make_pair(segs[i].filesz, i));
     }
+  }
+  sort(order.rbegin(), order.rend());
 
-    if ((phdr.p_flags & kElfPhdrTypeMask) == kElfPhdrTypeHash) {
-      offset = phdr.p_offset;
-      size = phdr.p_filesz;
-      return 0;
+  atomic<size_t> next(0);
+  auto worker = [&] {
+    for (size_t n = next++; n < order.size(); n = next++) {
+      int i = order[n].second;
+      const uint8_t *data = view.bytes(segs[i].offset, segs[i].filesz);
+      unsigned char digest[EVP_MAX_MD_SIZE];
+      unsigned len;
+      if (!data) {
+        info->seg_status[i] = kSegOutOfFile;
+      } else if (EVP_Digest(data, segs[i].filesz, digest, &len, md, NULL) &&
+                 memcmp(digest, table + i * md_len, md_len) == 0) {
+        info->seg_status[i] = kSegOk;
+      } else {
+        info->seg_status[i] = kSegMismatch;
+      }
     }
+  };
+  vector<thread> threads;
+  for (unsigned i = 1; i < jobs && i < order.size(); ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
   }
+  return 0;
+}
 
-  return -1;
+static bool hashes_ok(const image_info &info) {
+  for (int status : info.seg_status) {
+    if (status == kSegMismatch || status == kSegOutOfFile) {
+      return false;
+    }
+  }
+  return !info.hash_alg.empty();
 }
 
-static void usage(const char *cmd) {
-  fprintf(stderr, "%s [-d] img\n", cmd);
-  exit(-1);
+static void print_hashes(const image_info &info) {
+  printf("[*] Hash table (%s):\n", info.hash_alg.c_str());
+  for (size_t i = 0; i < info.seg_status.size(); ++i) {
+    printf("    Segment %zu: %s\n", i, seg_status_str(info.seg_status[i]));
+  }
 }
 
-static int find_hash_segment(int fd, uint32_t &hash_off, uint32_t &hash_sz) {
-  unsigned char ident[EI_NIDENT];
-  if (read(fd, ident, sizeof(ident)) != sizeof(ident)) {
-    perror("read");
-    return -1;
+// Public keys of the certificates seen so far, keyed by certificate SHA1.
+// Firmware trees sign most images with the same few certificates, so
+// this saves parsing them over and over.
+static mutex key_cache_lock;
+static map<string, shared_ptr<EVP_PKEY>> key_cache;
+
+static shared_ptr<EVP_PKEY> cert_key(const cert_info &ci) {
+  lock_guard<mutex> lock(key_cache_lock);
+  auto it = key_cache.find(ci.sha1);
+  if (it != key_cache.end()) {
+    return it->second;
   }
-  if (ident[0] != ELFMAG0 || ident[1] != ELFMAG1 || ident[2] != ELFMAG2 ||
-      ident[3] != ELFMAG3) {
-    fprintf(stderr, "Not elf format\n");
-    return -1;
+  const unsigned char *p =
+      reinterpret_cast<const unsigned char *>(ci.der.data());
+  unique_ptr<X509, void (*)(X509 *)> cert(d2i_X509(NULL, &p, ci.der.size()),
+                                          X509_free);
+  shared_ptr<EVP_PKEY> key;
+  if (cert) {
+    key.reset(X509_get_pubkey(cert.get()), EVP_PKEY_free);
   }
+  key_cache[ci.sha1] = key;
+  return key;
+}
 
-  if (lseek(fd, 0, SEEK_SET) == -1) {
-    perror("lseek");
-    return -1;
+// Checks that each of |certs| is issued and signed by the next one, and
+// that the last one is self-signed. The root is the one in the blob, so
+// this only proves the chain is intact; compare the root's SHA1 to a known
+// one to trust it.
+static string check_chain(const cert_info *certs, int n) {
+  for (int i = 0; i < n; ++i) {
+    const cert_info &issuer = certs[i + 1 < n ? i + 1 : i];
+    if (certs[i].issuer != issuer.subject) {
+      return "cert " + to_string(i + 1) + " isn't issued by cert " +
+             to_string(i + 1 < n ? i + 2 : i + 1);
+    }
+    shared_ptr<EVP_PKEY> key = cert_key(issuer);
+    const unsigned char *p =
+        reinterpret_cast<const unsigned char *>(certs[i].der.data());
+    unique_ptr<X509, void (*)(X509 *)> cert(
+        d2i_X509(NULL, &p, certs[i].der.size()), X509_free);
+    if (!key || !cert || X509_verify(cert.get(), key.get()) != 1) {
+      return "cert " + to_string(i + 1) + " has a bad signature";
+    }
   }
+  return "";
+}
 
-  int ret;
-  if (ident[EI_CLASS] == ELFCLASS32) {
-    ret = elf32_find_hashseg(fd, hash_off, hash_sz);
-  } else if (ident[EI_CLASS] == ELFCLASS64) {
-    ret = elf64_find_hashseg(fd, hash_off, hash_sz);
-  } else {
-    fprintf(stderr, "Invalid elf format\n");
-    return -1;
+// Reads the "01 0000000000000001 SW_ID" style OU field |name| of the
+// attestation certificate.
+static bool cert_ou_id(const cert_info &ci, const char *name, uint64_t *id) {
+  for (const auto &ou : ci.ous) {
+    unsigned idx;
+    unsigned long long v;
+    char field[32];
+    if (sscanf(ou.c_str(), "OU=%x %llx %31s", &idx, &v, field) == 3 &&
+        strcmp(field, name) == 0) {
+      *id = v;
+      return true;
+    }
   }
+  return false;
+}
 
-  return ret;
+static void put_be64(uint64_t v, unsigned char *p) {
+  for (int i = 7; i >= 0; --i) {
+    p[i] = v & 0xff;
+    v >>= 8;
+  }
 }
 
-static int print_metadata(int fd, uint32_t off, uint32_t sz, const char *type) {
-  if (sz == 0) {
-    return 0;
-  } else if (sz <= sizeof(metadata_base)) {
-    fprintf(stderr, "invalid metadata\n");
-    return -1;
+// The digest an RSA attestation key signs: H(data), or with SW_ID and
+// HW_ID in the certificate, the HMAC-like
+// H((HW_ID ^ opad) || H((SW_ID ^ ipad) || H(data))), as sectools makes it.
+static bool rsa_signed_digest(const uint8_t *data, size_t len,
+                              const cert_info &att, const EVP_MD *md,
+                              unsigned char *out, unsigned *out_len) {
+  if (!EVP_Digest(data, len, out, out_len, md, NULL)) {
+    return false;
+  }
+  uint64_t sw_id, hw_id;
+  if (!cert_ou_id(att, "SW_ID", &sw_id) || !cert_ou_id(att, "HW_ID", &hw_id)) {
+    return true;
   }
+  unsigned char buf[8 + EVP_MAX_MD_SIZE];
+  put_be64(sw_id ^ 0x3636363636363636ULL, buf);
+  memcpy(buf + 8, out, *out_len);
+  if (!EVP_Digest(buf, 8 + *out_len, out, out_len, md, NULL)) {
+    return false;
+  }
+  put_be64(hw_id ^ 0x5c5c5c5c5c5c5c5cULL, buf);
+  memcpy(buf + 8, out, *out_len);
+  return EVP_Digest(buf, 8 + *out_len, out, out_len, md, NULL);
+}
 
-  shared_ptr<metadata_base> meta_base(new metadata_base);
-  if (!meta_base) {
-    fprintf(stderr, "OOM\n");
-    return -1;
+static bool verify_digest(EVP_PKEY *key, const EVP_MD *md, int padding,
+                          const unsigned char *sig, size_t sig_len,
+                          const unsigned char *digest, size_t digest_len) {
+  unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> ctx(
+      EVP_PKEY_CTX_new(key, NULL), EVP_PKEY_CTX_free);
+  if (!ctx || EVP_PKEY_verify_init(ctx.get()) != 1 ||
+      EVP_PKEY_CTX_set_signature_md(ctx.get(), md) != 1) {
+    return false;
   }
+  if (padding && (EVP_PKEY_CTX_set_rsa_padding(ctx.get(), padding) != 1 ||
+                  (padding == RSA_PKCS1_PSS_PADDING &&
+                   EVP_PKEY_CTX_set_rsa_pss_saltlen(ctx.get(), -2) != 1))) {
+    return false;
+  }
+  return EVP_PKEY_verify(ctx.get(), sig, sig_len, digest, digest_len) == 1;
+}
 
-  if (read_file(fd, off, sizeof(metadata_base), meta_base.get()) == -1) {
-    return -1;
+// ECDSA signatures come DER encoded and padded to signature_size, or as
+// raw r || s. Returns the DER encoding without the padding.
+static string ecdsa_der(const uint8_t *sig, size_t len, EVP_PKEY *key) {
+  const unsigned char *p = sig;
+  unique_ptr<ECDSA_SIG, void (*)(ECDSA_SIG *)> s(d2i_ECDSA_SIG(NULL, &p, len),
+                                                 ECDSA_SIG_free);
+  if (s) {
+    return string(reinterpret_cast<const char *>(sig), p - sig);
   }
+  size_t n = (EVP_PKEY_bits(key) + 7) / 8;
+  if (len < 2 * n) {
+    return "";
+  }
+  s.reset(ECDSA_SIG_new());
+  BIGNUM *r = BN_bin2bn(sig, n, NULL);
+  BIGNUM *ss = BN_bin2bn(sig + n, n, NULL);
+  if (!s || !r || !ss || !ECDSA_SIG_set0(s.get(), r, ss)) {
+    BN_free(r);
+    BN_free(ss);
+    return "";
+  }
+  unsigned char *der = NULL;
+  int der_len = i2d_ECDSA_SIG(s.get(), &der);
+  if (der_len <= 0) {
+    return "";
+  }
+  string out(reinterpret_cast<char *>(der), der_len);
+  OPENSSL_free(der);
+  return out;
+}
 
-  if (meta_base->major != 0 || meta_base->minor != 0) {
-    fprintf(stderr, "unsupported version: %d.%d\n", meta_base->major,
-            meta_base->minor);
-    return -1;
+// Verifies the |sig_len| bytes at |sig_off| of the hash segment, made by
+// the first of the three certificates at |att|, over the header, metadata
+// and hash table.
+static sig_result verify_signature(const ElfView &view,
+                                   const image_info &info,
+                                   uint32_t sig_off, uint32_t sig_len,
+                                   const cert_info *att) {
+  sig_result res;
+  res.chain_error = check_chain(att, kMaxCerts);
+  res.chain_ok = res.chain_error.empty();
+
+  uint32_t signed_len = info.table_off + info.header.base.code_size;
+  const uint8_t *data = hash_seg_bytes(view, &info, 0, signed_len);
+  const uint8_t *sig = hash_seg_bytes(view, &info, sig_off, sig_len);
+  shared_ptr<EVP_PKEY> key = cert_key(att[0]);
+  if (!data || !sig || !key) {
+    res.scheme = "unknown";
+    return res;
   }
 
-  // Only support 0.0 now.
-  if (sz != sizeof(metadata_0_0)) {
-    fprintf(stderr, "invalid metadata version 0.0\n");
-    return -1;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned digest_len;
+  if (EVP_PKEY_base_id(key.get()) == EVP_PKEY_EC) {
+    // v6 images are signed over SHA-384, with the curve's own digest.
+    const EVP_MD *md = EVP_PKEY_bits(key.get()) > 256 ? EVP_sha384()
+                                                      : EVP_sha256();
+    res.scheme = string("ecdsa-") + md_name(md);
+    string der = ecdsa_der(sig, sig_len, key.get());
+    res.signature_ok =
+        !der.empty() &&
+        EVP_Digest(data, signed_len, digest, &digest_len, md, NULL) &&
+        verify_digest(key.get(), md, 0,
+                      reinterpret_cast<const unsigned char *>(der.data()),
+                      der.size(), digest, digest_len);
+    return res;
   }
 
-  shared_ptr<metadata_0_0> meta(new metadata_0_0);
-  if (!meta) {
-    fprintf(stderr, "OOM\n");
-    return -1;
+  // The hash table entries and the signature share the digest.
+  const EVP_MD *md = table_md(view, info);
+  if (!md) {
+    md = EVP_sha256();
+  }
+  if (!rsa_signed_digest(data, signed_len, att[0], md, digest, &digest_len)) {
+    res.scheme = "unknown";
+    return res;
+  }
+  res.scheme = string("rsa-pkcs1-") + md_name(md);
+  res.signature_ok = verify_digest(key.get(), md, RSA_PKCS1_PADDING, sig,
+                                   sig_len, digest, digest_len);
+  if (!res.signature_ok &&
+      verify_digest(key.get(), md, RSA_PKCS1_PSS_PADDING, sig, sig_len, digest,
+                    digest_len)) {
+    res.scheme = string("rsa-pss-") + md_name(md);
+    res.signature_ok = true;
   }
+  return res;
+}
+
+// Verifies the attestation signature of each certificate chain.
+static int verify_signatures(const ElfView &view, image_info *info) {
+  const mi_boot_image_header_type &h = info->header.base;
+  if (h.signature_size == 0) {
+    return fail(info, "Image isn't signed");
+  }
+  if (info->certs.size() < static_cast<size_t>(kMaxCerts)) {
+    return fail(info, "Incomplete cert chain");
+  }
+  uint32_t sig_off = info->table_off + h.code_size;
+  info->sigs.push_back(verify_signature(view, *info, sig_off,
+                                        h.signature_size, &info->certs[0]));
+  // A second chain follows its signature at the start of the last
+  // kKeyChainSize bytes, see parse_certs().
+  if (info->certs.size() == static_cast<size_t>(kMaxCerts * 2)) {
+    uint32_t cert_end = sig_off + h.signature_size + h.cert_chain_size;
+    info->sigs.push_back(verify_signature(view, *info,
+                                          cert_end - kKeyChainSize, 256,
+                                          &info->certs[kMaxCerts]));
+  }
+  return 0;
+}
+
+static bool signatures_ok(const image_info &info) {
+  for (const auto &sig : info.sigs) {
+    if (!sig.signature_ok || !sig.chain_ok) {
+      return false;
+    }
+  }
+  return !info.sigs.empty();
+}
+
+static void print_signatures(const image_info &info) {
+  for (size_t i = 0; i < info.sigs.size(); ++i) {
+    const sig_result &sig = info.sigs[i];
+    printf("[*] Signature %zu (%s): %s\n", i + 1, sig.scheme.c_str(),
+           sig.signature_ok ? "OK" : "BAD");
+    printf("    Chain: %s\n",
+           sig.chain_ok ? "OK" : sig.chain_error.c_str());
+  }
+}
 
-  if (read_file(fd, off, sizeof(metadata_0_0), meta.get()) == -1) {
+// Checks the segment hashes and the signatures.
+static int verify_image(const ElfView &view, image_info *info,
+                        unsigned jobs) {
+  if (verify_hashes(view, info, jobs) == -1) {
     return -1;
   }
+  return verify_signatures(view, info);
+}
+
+static bool image_ok(const image_info &info) {
+  return hashes_ok(info) && signatures_ok(info);
+}
 
+static void print_metadata(const metadata_0_0 *meta, const char *type) {
   printf("[*] %s METADATA:\n", type);
   printf("    SW_ID: %x\n", meta->sw_id);
   printf("    HW_ID(JTAG): %x\n", meta->hw_id);
@@ -378,57 +870,826 @@ static int print_metadata(int fd, uint32_t off, uint32_t sz, const char *type) {
   printf("    ROOT_REVOKE_ACTIVATE_ENABLE: %x\n", meta->root_revoke_activate_enable);
   printf("    UIE_KEY_SWITCH_ENABLE: %x\n", meta->uie_key_switch_enable);
   printf("    DEBUG: %x\n", meta->debug);
+}
+
+static void print_certs(const vector<cert_info> &certs) {
+  for (size_t i = 0; i < certs.size(); ++i) {
+    const cert_info &ci = certs[i];
+    printf("[*] Cert %zu:\n", i + 1);
+    printf("  Subject: %s\n", ci.subject.c_str());
+    printf("  Issuer : %s\n", ci.issuer.c_str());
+    printf("  Sha1   : %s\n", ci.sha1.c_str());
+    for (auto it = ci.ous.cbegin(); it != ci.ous.cend(); ++it) {
+      printf("  %s\n", it->c_str());
+    }
+  }
+}
+
+static int dump_certs(const vector<cert_info> &certs, const char *fn) {
+  for (size_t i = 0; i < certs.size(); ++i) {
+    string fni = fn + to_string(i + 1) + ".cert";
+    DBG("write cert to %s\n", fni.c_str());
+    ScopedFd fd(open(fni.c_str(), O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP));
+    if (!fd) {
+      perror("open");
+      return -1;
+    }
+    ssize_t len = certs[i].der.size();
+    if (write(fd.get(), certs[i].der.data(), len) != len) {
+      perror("write");
+      return -1;
+    }
+  }
   return 0;
 }
 
-static int print_ous_in_header(
-    int fd, uint32_t hash_off, uint32_t hash_sz,
-    shared_ptr<mi_boot_image_header_type_v6> header) {
-  uint32_t qti_md_sz = header->qti_md_size;
-  uint32_t qti_md_off = hash_off + sizeof(mi_boot_image_header_type_v6);
-  int ret = print_metadata(fd, qti_md_off, qti_md_sz, "QTI");
+static string json_string(const string &s) {
+  string out = "\"";
+  for (size_t i = 0; i < s.size(); ++i) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
 
-  uint32_t md_sz = header->md_size;
-  uint32_t md_off = qti_md_off + qti_md_sz;
-  ret = ret || print_metadata(fd, md_off, md_sz, "OEM");
-  return ret;
+static string json_uints(const uint32_t *v, int n) {
+  string out = "[";
+  for (int i = 0; i < n; ++i) {
+    out += (i ? ", " : "") + to_string(v[i]);
+  }
+  return out + "]";
 }
 
-static int find_certs(int fd, uint32_t hash_off, uint32_t hash_sz,
-                      uint32_t cert_off, uint32_t cert_sz, const char *dump_file) {
-  uint32_t off = hash_off + cert_off;
-  shared_ptr<char> buf(new char[cert_sz]);
-  if (!buf) {
-    fprintf(stderr, "OOM\n");
+static string json_metadata(const metadata_0_0 &m) {
+  return "{\"sw_id\": " + to_string(m.sw_id) +
+         ", \"hw_id\": " + to_string(m.hw_id) +
+         ", \"oem_id\": " + to_string(m.oem_id) +
+         ", \"model_id\": " + to_string(m.model_id) +
+         ", \"app_id\": " + to_string(m.app_id) +
+         ", \"soc_vers\": " + json_uints(m.soc_vers, 12) +
+         ", \"multi_serial_numbers\": " +
+         json_uints(m.multi_serial_numbers, 8) +
+         ", \"anti_rollback_version\": " + to_string(m.anti_rollback_version) +
+         ", \"rot_en\": " + to_string(m.rot_en) +
+         ", \"in_use_soc_hw_version\": " + to_string(m.in_use_soc_hw_version) +
+         ", \"use_serial_number_in_signing\": " +
+         to_string(m.use_serial_number_in_signing) +
+         ", \"oem_id_independent\": " + to_string(m.oem_id_independent) +
+         ", \"root_revoke_activate_enable\": " +
+         to_string(m.root_revoke_activate_enable) +
+         ", \"uie_key_switch_enable\": " + to_string(m.uie_key_switch_enable) +
+         ", \"debug\": " + to_string(m.debug) + "}";
+}
+
+// One line of JSON for |info|, with whatever was parsed before an error.
+static string json_image(const image_info &info) {
+  string out = "{\"path\": " + json_string(info.path);
+  if (info.elf_size) {
+    out += ", \"offset\": " + to_string(info.elf_off) +
+           ", \"size\": " + to_string(info.elf_size);
+  }
+  if (!info.error.empty()) {
+    out += ", \"error\": " + json_string(info.error);
+  }
+  if (info.hash_sz) {
+    const mi_boot_image_header_type &h = info.header.base;
+    out += ", \"hash_segment\": {\"offset\": " + to_string(info.hash_off) +
+           ", \"size\": " + to_string(info.hash_sz) +
+           ", \"version\": " + to_string(h.version) +
+           ", \"image_size\": " + to_string(h.image_size) +
+           ", \"code_size\": " + to_string(h.code_size) +
+           ", \"signature_size\": " + to_string(h.signature_size) +
+           ", \"cert_chain_size\": " + to_string(h.cert_chain_size);
+    if (h.version == kMbnV6) {
+      out += ", \"qti_md_size\": " + to_string(info.header.qti_md_size) +
+             ", \"md_size\": " + to_string(info.header.md_size);
+    }
+    out += "}";
+  }
+  if (info.has_qti_md) {
+    out += ", \"qti_metadata\": " + json_metadata(info.qti_md);
+  }
+  if (info.has_oem_md) {
+    out += ", \"oem_metadata\": " + json_metadata(info.oem_md);
+  }
+  out += ", \"certs\": [";
+  for (size_t i = 0; i < info.certs.size(); ++i) {
+    const cert_info &ci = info.certs[i];
+    out += (i ? ", " : "");
+    out += "{\"subject\": " + json_string(ci.subject) +
+           ", \"issuer\": " + json_string(ci.issuer) +
+           ", \"sha1\": " + json_string(ci.sha1) + ", \"ou\": [";
+    for (size_t j = 0; j < ci.ous.size(); ++j) {
+      out += (j ? ", " : "") + json_string(ci.ous[j]);
+    }
+    out += "]}";
+  }
+  out += "]";
+  if (!info.hash_alg.empty()) {
+    out += ", \"hashes\": {\"alg\": " + json_string(info.hash_alg) +
+           ", \"ok\": " + (hashes_ok(info) ? "true" : "false") +
+           ", \"segments\": [";
+    for (size_t i = 0; i < info.seg_status.size(); ++i) {
+      out += (i ? ", " : "") +
+             json_string(seg_status_str(info.seg_status[i]));
+    }
+    out += "]}";
+  }
+  if (!info.sigs.empty()) {
+    out += ", \"signatures\": [";
+    for (size_t i = 0; i < info.sigs.size(); ++i) {
+      const sig_result &sig = info.sigs[i];
+      out += (i ? ", " : "");
+      out += "{\"scheme\": " + json_string(sig.scheme) +
+             ", \"ok\": " + (sig.signature_ok ? "true" : "false") +
+             ", \"chain_ok\": " + (sig.chain_ok ? "true" : "false");
+      if (!sig.chain_ok) {
+        out += ", \"chain_error\": " + json_string(sig.chain_error);
+      }
+      out += "}";
+    }
+    out += "]";
+  }
+  return out + "}";
+}
+
+// A file seen by the tree walk.
+struct tree_file {
+  string path;
+  uint64_t size;
+  int64_t mtime;  // Nanoseconds.
+};
+
+static vector<tree_file> *walk_files;
+
+static int walk_add(const char *path, const struct stat *st, int type,
+                    struct FTW *ftw) {
+  (void)ftw;
+  if (type == FTW_F) {
+    walk_files->push_back({path, static_cast<uint64_t>(st->st_size),
+                           st->st_mtim.tv_sec * 1000000000LL +
+                               st->st_mtim.tv_nsec});
+  }
+  return 0;
+}
+
+static int walk_tree(const char *dir, vector<tree_file> *files) {
+  walk_files = files;
+  if (nftw(dir, walk_add, 64, FTW_PHYS) == -1) {
+    perror(dir);
+    return -1;
+  }
+  sort(files->begin(), files->end(),
+       [](const tree_file &a, const tree_file &b) { return a.path < b.path; });
+  return 0;
+}
+
+// The --index file: the certs seen, and the chain of every file under
+// the indexed trees, as lines of tab separated fields:
+//   C SHA1 SUBJECT ISSUER OU...
+//   I SIZE MTIME CHAIN METADATA PATH
+// CHAIN is the comma separated cert SHA1s, empty for ELFs without certs
+// and "-" for other files. METADATA is the comma separated IDs of the QTI
+// and OEM metadata of v6 images, each as SW_ID/HW_ID/OEM_ID/MODEL_ID in
+// hex, and "-" for images without it. Files are parsed again only when
+// their size or mtime changes, or when a version 1 index, which has no
+// METADATA, recorded them.
+static const char *kIndexMagic = "qcert-index 2";
+static const char *kIndexMagicV1 = "qcert-index 1";
+
+// The IDs of a metadata_0_0, as the index keeps them.
+struct metadata_ids {
+  uint32_t sw_id;
+  uint32_t hw_id;
+  uint32_t oem_id;
+  uint32_t model_id;
+};
+
+struct index_entry {
+  uint64_t size;
+  int64_t mtime;
+  string chain;
+  vector<metadata_ids> metadata;
+  // From a version 1 index, without the metadata.
+  bool stale;
+};
+
+static map<string, index_entry> index_files;
+
+static string index_escape(const string &s) {
+  string out;
+  for (char c : s) {
+    if (c == '\\') {
+      out += "\\\\";
+    } else if (c == '\t') {
+      out += "\\t";
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+static string index_unescape(const string &s) {
+  string out;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '\\' && i + 1 < s.size()) {
+      char c = s[++i];
+      out += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+static vector<string> split(const string &s, char sep) {
+  vector<string> fields;
+  size_t pos = 0;
+  for (;;) {
+    size_t next = s.find(sep, pos);
+    fields.push_back(s.substr(pos, next - pos));
+    if (next == string::npos) {
+      return fields;
+    }
+    pos = next + 1;
+  }
+}
+
+// Loads |path| into cert_cache and index_files. A missing index is empty.
+static int load_index(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    perror(path);
+    return -1;
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  bool ok = getline(&line, &cap, fp) > 0;
+  bool v1 = ok && strncmp(line, kIndexMagicV1, strlen(kIndexMagicV1)) == 0;
+  ok = ok && (v1 || strncmp(line, kIndexMagic, strlen(kIndexMagic)) == 0);
+  while (ok && (len = getline(&line, &cap, fp)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+    }
+    vector<string> f = split(line, '\t');
+    if (f[0] == "C" && f.size() >= 4) {
+      cert_info ci;
+      ci.sha1 = f[1];
+      ci.subject = index_unescape(f[2]);
+      ci.issuer = index_unescape(f[3]);
+      for (size_t i = 4; i < f.size(); ++i) {
+        ci.ous.push_back(index_unescape(f[i]));
+      }
+      cert_cache[ci.sha1] = ci;
+    } else if (f[0] == "I" && f.size() == (v1 ? 5u : 6u)) {
+      index_entry e = {strtoull(f[1].c_str(), NULL, 10),
+                       strtoll(f[2].c_str(), NULL, 10), f[3], {}, v1};
+      if (!v1 && f[4] != "-") {
+        for (const auto &md : split(f[4], ',')) {
+          metadata_ids ids;
+          ok = ok && sscanf(md.c_str(), "%x/%x/%x/%x", &ids.sw_id, &ids.hw_id,
+                            &ids.oem_id, &ids.model_id) == 4;
+          e.metadata.push_back(ids);
+        }
+      }
+      index_files[index_unescape(f.back())] = e;
+    } else {
+      ok = false;
+    }
+  }
+  free(line);
+  fclose(fp);
+  if (!ok) {
+    fprintf(stderr, "%s: not a qcert index\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// Writes the index to a temporary file and renames it over |path|, so it
+// is never seen half written.
+static int save_index(const char *path) {
+  string tmp = string(path) + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if (!fp) {
+    perror(tmp.c_str());
+    return -1;
+  }
+  fprintf(fp, "%s\n", kIndexMagic);
+  for (const auto &c : cert_cache) {
+    const cert_info &ci = c.second;
+    fprintf(fp, "C\t%s\t%s\t%s", ci.sha1.c_str(),
+            index_escape(ci.subject).c_str(), index_escape(ci.issuer).c_str());
+    for (const auto &ou : ci.ous) {
+      fprintf(fp, "\t%s", index_escape(ou).c_str());
+    }
+    fprintf(fp, "\n");
+  }
+  for (const auto &f : index_files) {
+    string metadata;
+    for (const auto &ids : f.second.metadata) {
+      char buf[48];
+      snprintf(buf, sizeof(buf), "%s%x/%x/%x/%x", metadata.empty() ? "" : ",",
+               ids.sw_id, ids.hw_id, ids.oem_id, ids.model_id);
+      metadata += buf;
+    }
+    fprintf(fp, "I\t%llu\t%lld\t%s\t%s\t%s\n",
+            static_cast<unsigned long long>(f.second.size),
+            static_cast<long long>(f.second.mtime), f.second.chain.c_str(),
+            metadata.empty() ? "-" : metadata.c_str(),
+            index_escape(f.first).c_str());
+  }
+  if (fclose(fp) != 0 || rename(tmp.c_str(), path) == -1) {
+    perror(path);
+    unlink(tmp.c_str());
     return -1;
   }
+  return 0;
+}
 
-  if (read_file(fd, off, cert_sz, buf.get()) == -1) {
+// |path| with its directory made absolute, for a file that may not exist
+// yet. |path| itself if the directory can't be resolved.
+static string absolute_path(const char *path) {
+  string p = path;
+  size_t slash = p.rfind('/');
+  string dir = slash == string::npos ? "." : p.substr(0, slash + 1);
+  char *real = realpath(dir.c_str(), NULL);
+  if (!real) {
+    return p;
+  }
+  string out = real;
+  free(real);
+  if (out[out.size() - 1] != '/') {
+    out += '/';
+  }
+  return out + p.substr(slash == string::npos ? 0 : slash + 1);
+}
+
+// Brings the entries of the files under |dir| in |index_path| up to date,
+// parsing the new and changed ones on |jobs| threads. Certs no entry
+// refers to any more are dropped.
+static int index_tree(const char *dir, unsigned jobs, const char *index_path) {
+  if (load_index(index_path) == -1) {
+    return -1;
+  }
+  // Entries are kept by absolute path, however |dir| was given.
+  char *real = realpath(dir, NULL);
+  if (!real) {
+    perror(dir);
     return -1;
   }
+  string prefix = real;
+  free(real);
+  vector<tree_file> files;
+  if (walk_tree(prefix.c_str(), &files) == -1) {
+    return -1;
+  }
+  // The index may be kept in the tree it indexes.
+  string index_abs = absolute_path(index_path);
+  files.erase(remove_if(files.begin(), files.end(),
+                        [&](const tree_file &f) {
+                          return f.path == index_abs ||
+                                 f.path == index_abs + ".tmp";
+                        }),
+              files.end());
+
+  // Entries of files that are gone.
+  if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+    prefix += '/';
+  }
+  for (auto it = index_files.lower_bound(prefix);
+       it != index_files.end() && it->first.compare(0, prefix.size(),
+                                                    prefix) == 0;) {
+    if (!binary_search(files.begin(), files.end(), tree_file{it->first, 0, 0},
+                       [](const tree_file &a, const tree_file &b) {
+                         return a.path < b.path;
+                       })) {
+      it = index_files.erase(it);
+    } else {
+      ++it;
+    }
+  }
 
-  if (dump_file) {
-    return print_certs(buf, cert_sz, dump_file);
+  vector<size_t> todo;
+  for (size_t i = 0; i < files.size(); ++i) {
+    auto it = index_files.find(files[i].path);
+    if (it == index_files.end() || it->second.stale ||
+        it->second.size != files[i].size ||
+        it->second.mtime != files[i].mtime) {
+      todo.push_back(i);
+    }
+  }
+  vector<string> chains(todo.size(), "-");
+  vector<vector<metadata_ids>> metadata(todo.size());
+  atomic<size_t> next(0);
+  auto worker = [&] {
+    for (size_t n = next++; n < todo.size(); n = next++) {
+      ElfView view;
+      if (view.open(files[todo[n]].path.c_str()) == -1 || !view.is_elf()) {
+        continue;
+      }
+      image_info info;
+      parse_image(view, &info);
+      chains[n].clear();
+      for (size_t i = 0; i < info.certs.size(); ++i) {
+        chains[n] += (i ? "," : "") + info.certs[i].sha1;
+      }
+      for (const metadata_0_0 *md :
+           {info.has_qti_md ? &info.qti_md : NULL,
+            info.has_oem_md ? &info.oem_md : NULL}) {
+        if (md) {
+          metadata[n].push_back(
+              {md->sw_id, md->hw_id, md->oem_id, md->model_id});
+        }
+      }
+    }
+  };
+  vector<thread> threads;
+  for (unsigned i = 1; i < jobs && i < todo.size(); ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  for (size_t n = 0; n < todo.size(); ++n) {
+    const tree_file &f = files[todo[n]];
+    index_files[f.path] = {f.size, f.mtime, chains[n], metadata[n], false};
+  }
+  set<string> used;
+  for (const auto &f : index_files) {
+    if (f.second.chain != "-") {
+      for (const auto &sha1 : split(f.second.chain, ',')) {
+        used.insert(sha1);
+      }
+    }
+  }
+  for (auto it = cert_cache.begin(); it != cert_cache.end();) {
+    if (used.count(it->first)) {
+      ++it;
+    } else {
+      it = cert_cache.erase(it);
+    }
+  }
+  fprintf(stderr, "%zu files, %zu parsed, %zu certs known\n", files.size(),
+          todo.size(), cert_cache.size());
+  return save_index(index_path);
+}
+
+// Whether |ids| has the ID |name| ("SW_ID", ...) of value |id|. HW_ID
+// matches the JTAG ID alone or, as the HW_ID OU has it, that ID followed
+// by the OEM and model IDs.
+static bool metadata_id_matches(const metadata_ids &ids, const string &name,
+                                uint64_t id) {
+  if (name == "SW_ID") {
+    return id == ids.sw_id;
+  } else if (name == "HW_ID") {
+    return id == ids.hw_id ||
+           id == (static_cast<uint64_t>(ids.hw_id) << 32 |
+                  (ids.oem_id & 0xffff) << 16 | (ids.model_id & 0xffff));
+  } else if (name == "OEM_ID") {
+    return id == ids.oem_id;
+  }
+  return id == ids.model_id;
+}
+
+// Whether the three certs at |chain| satisfy every key=value term of
+// |terms|. Keys are root and cert (a cert SHA1), and sw_id, hw_id, oem_id
+// and model_id (hex). The IDs come from one of the image's |metadata|
+// when it has any, as v6 images do, else from the attestation cert's OUs.
+static bool chain_matches(const vector<string> &chain, size_t first,
+                          const vector<metadata_ids> &metadata,
+                          const vector<string> &terms) {
+  // Which metadata still satisfy all the ID terms so far.
+  vector<bool> md_ok(metadata.size(), true);
+  for (const auto &term : terms) {
+    size_t eq = term.find('=');
+    string key = term.substr(0, eq);
+    string value = eq == string::npos ? "" : term.substr(eq + 1);
+    if (key == "root") {
+      if (strcasecmp(chain[first + kMaxCerts - 1].c_str(), value.c_str())) {
+        return false;
+      }
+    } else if (key == "cert") {
+      bool found = false;
+      for (int i = 0; i < kMaxCerts; ++i) {
+        found = found || !strcasecmp(chain[first + i].c_str(), value.c_str());
+      }
+      if (!found) {
+        return false;
+      }
+    } else if (!metadata.empty()) {
+      string name = key;
+      transform(name.begin(), name.end(), name.begin(), ::toupper);
+      uint64_t want = strtoull(value.c_str(), NULL, 16);
+      bool found = false;
+      for (size_t i = 0; i < metadata.size(); ++i) {
+        md_ok[i] = md_ok[i] && metadata_id_matches(metadata[i], name, want);
+        found = found || md_ok[i];
+      }
+      if (!found) {
+        return false;
+      }
+    } else {
+      string name = key;
+      transform(name.begin(), name.end(), name.begin(), ::toupper);
+      auto it = cert_cache.find(chain[first]);
+      uint64_t id;
+      if (it == cert_cache.end() ||
+          !cert_ou_id(it->second, name.c_str(), &id) ||
+          id != strtoull(value.c_str(), NULL, 16)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Prints the paths of the indexed images with a chain matching |query|,
+// comma separated key=value terms.
+static int query_index(const char *index_path, const char *query) {
+  if (load_index(index_path) == -1) {
+    return -1;
+  }
+  vector<string> terms = split(query, ',');
+  for (const auto &term : terms) {
+    string key = term.substr(0, term.find('='));
+    if (key != "root" && key != "cert" && key != "sw_id" && key != "hw_id" &&
+        key != "oem_id" && key != "model_id") {
+      fprintf(stderr, "unknown query key %s\n", key.c_str());
+      return -1;
+    }
+  }
+  for (const auto &f : index_files) {
+    if (f.second.chain.empty() || f.second.chain == "-") {
+      continue;
+    }
+    vector<string> chain = split(f.second.chain, ',');
+    for (size_t first = 0; first + kMaxCerts <= chain.size();
+         first += kMaxCerts) {
+      if (chain_matches(chain, first, f.second.metadata, terms)) {
+        printf("%s\n", f.first.c_str());
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+// Prints a JSON record per ELF file under |dir|, in path order. The files
+// are parsed on |jobs| threads. With |verify|, fails if any image doesn't
+// parse or has a bad segment hash or signature.
+static int scan_tree(const char *dir, unsigned jobs, bool verify) {
+  vector<tree_file> files;
+  if (walk_tree(dir, &files) == -1) {
+    return -1;
+  }
+
+  // Empty for files that aren't ELF.
+  vector<string> records(files.size());
+  atomic<bool> ok(true);
+  atomic<size_t> next(0);
+  auto worker = [&] {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      ElfView view;
+      if (view.open(files[i].path.c_str()) == -1 || !view.is_elf()) {
+        continue;
+      }
+      image_info info;
+      info.path = files[i].path;
+      // Images already run in parallel, so each hashes its own segments.
+      int ret = parse_image(view, &info);
+      if (ret == 0 && verify) {
+        ret = verify_image(view, &info, 1);
+      }
+      if (verify && (ret == -1 || !image_ok(info))) {
+        ok = false;
+      }
+      records[i] = json_image(info);
+    }
+  };
+  vector<thread> threads;
+  for (unsigned i = 1; i < jobs && i < files.size(); ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  for (const auto &r : records) {
+    if (!r.empty()) {
+      printf("%s\n", r.c_str());
+    }
+  }
+  return ok ? 0 : 1;
+}
+
+// Maps |spec|, a file or, as ResolveRange() takes it, part of one such as
+// "factory.zip!abl.elf", "UPDATE.APP!ABL.img" or "dump.bin@0x3000+0x50000".
+static int open_input(const char *spec, ElfView *view) {
+  FileRange range;
+  Error err = ResolveRange(spec, &range);
+  if (!err.ok()) {
+    fprintf(stderr, "%s\n", err.message().c_str());
+    return -1;
+  }
+  if (view->open(range.path.c_str(), range.offset, range.size) == -1) {
+    perror(range.path.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+// Bytes taken by the ELF at the start of |view|: its headers and all its
+// segments. 0 if a program header or a segment lies outside the view, as
+// for a stray "\177ELF" in a dump.
+static uint64_t elf_extent(const ElfView &view) {
+  uint64_t end;
+  uint64_t phoff;
+  uint64_t phentsize;
+  int cls = view.elf_class();
+  Elf32_Ehdr ehdr32;
+  Elf64_Ehdr ehdr64;
+  if (cls == ELFCLASS32 && view.ehdr32(&ehdr32)) {
+    end = sizeof(ehdr32);
+    phoff = ehdr32.e_phoff;
+    phentsize = ehdr32.e_phentsize;
+    if (phentsize != sizeof(Elf32_Phdr)) {
+      return 0;
+    }
+  } else if (cls == ELFCLASS64 && view.ehdr64(&ehdr64)) {
+    end = sizeof(ehdr64);
+    phoff = ehdr64.e_phoff;
+    phentsize = ehdr64.e_phentsize;
+    if (phentsize != sizeof(Elf64_Phdr)) {
+      return 0;
+    }
   } else {
-    return print_certs(buf, cert_sz);
+    return 0;
   }
+  int phnum = view.phnum();
+  if (phnum == 0 || !view.bytes(phoff, phnum * phentsize)) {
+    return 0;
+  }
+  end = max(end, phoff + phnum * phentsize);
+  elf_segment seg;
+  for (int i = 0; i < phnum; ++i) {
+    if (!view.segment(i, &seg) || !view.bytes(seg.offset, seg.filesz)) {
+      return 0;
+    }
+    end = max(end, seg.offset + seg.filesz);
+  }
+  return end;
 }
 
+// Size of the pieces of a dump searched by one thread at a time.
+static const uint64_t kScanChunkSize = 16 << 20;
+
+// Prints a JSON record, with its offset and size, for each signed ELF
+// embedded in |path|, such as a partition or memory dump, in offset order.
+// Hits of the ELF magic are looked for on |jobs| threads and kept if their
+// program headers and segments fit in the file and they have a hash
+// segment. With |verify|, fails if any of them doesn't parse or has a bad
+// segment hash or signature.
+static int scan_image(const char *path, unsigned jobs, bool verify) {
+  ElfView view;
+  if (open_input(path, &view) == -1) {
+    return -1;
+  }
+  const uint8_t *data = view.bytes(0, view.size());
+  uint64_t size = view.size();
+  uint64_t chunks = (size + kScanChunkSize - 1) / kScanChunkSize;
+
+  mutex records_lock;
+  map<uint64_t, string> records;
+  atomic<bool> ok(true);
+  atomic<uint64_t> next(0);
+  auto worker = [&] {
+    for (uint64_t c = next++; c < chunks; c = next++) {
+      // A magic starting in this chunk may end in the next one.
+      uint64_t begin = c * kScanChunkSize;
+      uint64_t end = min(size, begin + kScanChunkSize + SELFMAG - 1);
+      const uint8_t *p = data + begin;
+      while ((p = static_cast<const uint8_t *>(
+                  memmem(p, data + end - p, ELFMAG, SELFMAG))) != NULL) {
+        uint64_t off = p - data;
+        ++p;
+        ElfView elf;
+        elf.assign(data + off, size - off);
+        uint64_t extent = elf_extent(elf);
+        if (!extent) {
+          continue;
+        }
+        // Keep the image from reaching into whatever follows it.
+        elf.assign(data + off, extent);
+        image_info info;
+        info.path = path;
+        info.elf_off = off;
+        info.elf_size = extent;
+        if (parse_image(elf, &info) == -1 && !info.hash_sz) {
+          continue;
+        }
+        if (verify && (!info.error.empty() ||
+                       verify_image(elf, &info, 1) == -1 || !image_ok(info))) {
+          ok = false;
+        }
+        string record = json_image(info);
+        lock_guard<mutex> lock(records_lock);
+        records[off] = record;
+      }
+    }
+  };
+  vector<thread> threads;
+  for (unsigned i = 1; i < jobs && i < chunks; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  for (const auto &r : records) {
+    printf("%s\n", r.second.c_str());
+  }
+  return ok ? 0 : 1;
+}
+
+// qcert_bench builds this file without main() to time its parts.
+#ifndef QCERT_NO_MAIN
 int main(int argc, char **argv) {
   int dump = 0;
-  char *dump_file = NULL;
+  int json = 0;
+  int verify = 0;
+  const char *recursive = NULL;
+  const char *index = NULL;
+  const char *query = NULL;
+  const char *scan = NULL;
+  unsigned jobs = thread::hardware_concurrency();
   int c;
   const char *cmd = argv[0];
   struct option options[] = {
       {"dump", no_argument, NULL, 'd'},
+      {"json", no_argument, NULL, 'J'},
+      {"recursive", required_argument, NULL, 'r'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"verify", no_argument, NULL, 'V'},
+      {"index", required_argument, NULL, 'i'},
+      {"query", required_argument, NULL, 'q'},
+      {"scan", required_argument, NULL, 's'},
       {NULL, 0, NULL, 0},
   };
 
-  while ((c = getopt_long(argc, argv, "d", options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "dr:j:Vi:q:s:", options, NULL)) != -1) {
     switch (c) {
       case 'd':
         dump = 1;
         break;
+      case 'J':
+        json = 1;
+        break;
+      case 'r':
+        recursive = optarg;
+        break;
+      case 'j': {
+        char *end;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end || n <= 0 || n > INT_MAX) {
+          fprintf(stderr, "%s: bad number of jobs: %s\n", cmd, optarg);
+          usage(cmd);
+        }
+        jobs = n;
+        break;
+      }
+      case 'V':
+        verify = 1;
+        break;
+      case 'i':
+        index = optarg;
+        break;
+      case 'q':
+        query = optarg;
+        break;
+      case 's':
+        scan = optarg;
+        break;
       default:
         usage(cmd);
         break;
@@ -437,69 +1698,68 @@ int main(int argc, char **argv) {
   argc -= optind;
   argv += optind;
 
+  if (scan) {
+    if (argc != 0 || recursive || index || query) {
+      usage(cmd);
+    }
+    return scan_image(scan, jobs ? jobs : 1, verify);
+  }
+  if (query) {
+    if (argc != 0 || !index || recursive) {
+      usage(cmd);
+    }
+    return query_index(index, query) == -1 ? -1 : 0;
+  }
+  if (index) {
+    if (argc != 0 || !recursive) {
+      usage(cmd);
+    }
+    return index_tree(recursive, jobs ? jobs : 1, index) == -1 ? -1 : 0;
+  }
+  if (recursive) {
+    if (argc != 0) {
+      usage(cmd);
+    }
+    return scan_tree(recursive, jobs ? jobs : 1, verify);
+  }
   if (argc != 1) {
     usage(cmd);
   }
-  if (dump) {
-    dump_file = argv[0];
-  }
 
-  ScopedFd fd(open(argv[0], O_RDONLY));
-  if (!fd) {
-    perror("open");
+  ElfView view;
+  if (open_input(argv[0], &view) == -1) {
     return -1;
   }
 
-  uint32_t hash_off, hash_sz;
-  if (find_hash_segment(fd.get(), hash_off, hash_sz) == -1) {
-    //fprintf(stderr, "Can't find hash segment\n");
-    return -1;
+  image_info info;
+  info.path = argv[0];
+  int ret = parse_image(view, &info);
+  if (ret == 0 && verify) {
+    ret = verify_image(view, &info, jobs ? jobs : 1);
   }
-  DBG("hash segment: %x %x\n", hash_off, hash_sz);
-
-  shared_ptr<mi_boot_image_header_type> header(new mi_boot_image_header_type);
-  if (!header) {
-    fprintf(stderr, "OOM\n");
-    return -1;
+  if (json) {
+    printf("%s\n", json_image(info).c_str());
+    return ret == 0 && (!verify || image_ok(info)) ? 0 : -1;
   }
-
-  if (read_file(fd.get(), hash_off, kHashSegHeaderSz, header.get()) == -1) {
+  if (ret == -1) {
+    fprintf(stderr, "%s\n", info.error.c_str());
     return -1;
   }
-
-  // TODO: support -d(--dump)
-
-  if (header->version > kMbnV6) {
-    fprintf(stderr, "Unsupported mbn version %d\n", header->version);
-    return -1;
-  } else if (header->version == kMbnV6) {
-    DBG("V6 header\n");
-    shared_ptr<mi_boot_image_header_type_v6> header_v6(
-        new mi_boot_image_header_type_v6);
-    if (read_file(fd.get(), hash_off, kHashSegHeaderSzV6, header_v6.get()) ==
-        -1) {
-      return -1;
-    }
-    uint32_t cert_off = sizeof(mi_boot_image_header_type_v6) +
-                        header_v6->qti_md_size +
-                        header_v6->md_size +
-                        header_v6->base.code_size +
-                        header_v6->base.signature_size;
-    DBG("cert: %x %x\n", cert_off, header_v6->base.cert_chain_size);
-    if (dump_file) {
-      return find_certs(fd.get(), hash_off, hash_sz, cert_off,
-                   header_v6->base.cert_chain_size, dump_file);
-    } else {
-      if (print_ous_in_header(fd.get(), hash_off, hash_sz, header_v6) ||
-          find_certs(fd.get(), hash_off, hash_sz, cert_off,
-                     header_v6->base.cert_chain_size, dump_file)) {
-        return -1;
-      }
-    }
-  } else {
-    uint32_t cert_off = sizeof(mi_boot_image_header_type) + header->code_size +
-                        header->signature_size;
-    return find_certs(fd.get(), hash_off, hash_sz, cert_off,
-                      header->cert_chain_size, dump_file);
+  if (dump) {
+    return dump_certs(info.certs, argv[0]);
+  }
+  if (info.has_qti_md) {
+    print_metadata(&info.qti_md, "QTI");
   }
+  if (info.has_oem_md) {
+    print_metadata(&info.oem_md, "OEM");
+  }
+  print_certs(info.certs);
+  if (verify) {
+    print_hashes(info);
+    print_signatures(info);
+    return image_ok(info) ? 0 : -1;
+  }
+  return 0;
 }
+#endif  // QCERT_NO_MAIN
@@ -0,0 +1,268 @@
+// Times the parts of qcert on a set of images: each step on each image
+// alone, then parse and verify sweeps over all of them on one and on all
+// threads. Built from qcert.cc itself, so the code timed is qcert's own.
+
+#define QCERT_NO_MAIN
+#include "qcert.cc"
+
+#include <time.h>
+#include <functional>
+
+namespace {
+
+struct BenchImage {
+  string name;
+  ElfView view;
+  // Parsed and verified once up front; steps start from copies.
+  image_info info;
+};
+
+}  // namespace
+
+static const char *bench_usage =
+    "Usage: qcert_bench [-j jobs] [-t seconds] IMAGE...\n"
+    "  -j, --jobs         - threads of the batch runs (default: CPU count)\n"
+    "  -t, --time SECS    - least time spent on each step (default: 0.2)\n"
+    "  IMAGE may be any input qcert takes, such as UPDATE.APP!ABL.img\n";
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs |step| with stdout silenced until |min_time| has passed, and
+// returns the seconds per run and the number of runs.
+static double Time(double min_time, const function<void()> &step,
+                   unsigned *runs) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  double begin = Now();
+  double end;
+  unsigned n = 0;
+  do {
+    step();
+    ++n;
+    end = Now();
+  } while (end - begin < min_time);
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  *runs = n;
+  return (end - begin) / n;
+}
+
+// Prints a line of results. |bytes| is the data a run goes through, 0 if
+// that doesn't apply.
+static void Report(const string &name, const char *step, unsigned runs,
+                   double secs, uint64_t bytes) {
+  printf("%-28s %-13s %8u %12.2f", name.c_str(), step, runs, secs * 1e6);
+  if (bytes) {
+    printf(" %10.1f\n", bytes / (1024.0 * 1024) / secs);
+  } else {
+    printf(" %10s\n", "-");
+  }
+}
+
+static void ClearCaches() {
+  {
+    lock_guard<mutex> lock(cert_cache_lock);
+    cert_cache.clear();
+  }
+  lock_guard<mutex> lock(key_cache_lock);
+  key_cache.clear();
+}
+
+static void BenchSteps(BenchImage *img, double min_time) {
+  const ElfView &view = img->view;
+  const image_info &base = img->info;
+  const mi_boot_image_header_type_v6 &h = base.header;
+  unsigned runs;
+  double secs;
+
+  secs = Time(min_time, [&] {
+    image_info info;
+    find_hash_segment(view, &info);
+  }, &runs);
+  Report(img->name, "find_hash", runs, secs, 0);
+
+  if (base.has_qti_md || base.has_oem_md) {
+    secs = Time(min_time, [&] {
+      image_info info = base;
+      uint32_t off = sizeof(mi_boot_image_header_type_v6);
+      if (base.has_qti_md) {
+        parse_metadata(view, off, h.qti_md_size, "QTI", &info.qti_md, &info);
+        print_metadata(&info.qti_md, "QTI");
+      }
+      if (base.has_oem_md) {
+        parse_metadata(view, off + h.qti_md_size, h.md_size, "OEM",
+                       &info.oem_md, &info);
+        print_metadata(&info.oem_md, "OEM");
+      }
+    }, &runs);
+    Report(img->name, "metadata", runs, secs, 0);
+  }
+
+  uint32_t cert_off =
+      base.table_off + h.base.code_size + h.base.signature_size;
+  const uint8_t *certs =
+      hash_seg_bytes(view, &base, cert_off, h.base.cert_chain_size);
+  for (bool cached : {false, true}) {
+    secs = Time(min_time, [&] {
+      if (!cached) {
+        ClearCaches();
+      }
+      image_info info;
+      parse_certs(certs, h.base.cert_chain_size, &info);
+      print_certs(info.certs);
+    }, &runs);
+    Report(img->name, cached ? "certs-cached" : "certs", runs, secs, 0);
+  }
+
+  secs = Time(min_time, [&] {
+    image_info info = base;
+    info.seg_status.clear();
+    verify_hashes(view, &info, 1);
+  }, &runs);
+  Report(img->name, "hashes", runs, secs, view.size());
+
+  for (bool cached : {false, true}) {
+    secs = Time(min_time, [&] {
+      if (!cached) {
+        ClearCaches();
+      }
+      image_info info = base;
+      info.sigs.clear();
+      verify_signatures(view, &info);
+    }, &runs);
+    Report(img->name, cached ? "sigs-cached" : "signatures", runs, secs, 0);
+  }
+
+  secs = Time(min_time, [&] {
+    image_info info;
+    parse_image(view, &info);
+    verify_image(view, &info, 1);
+  }, &runs);
+  Report(img->name, "parse+verify", runs, secs, view.size());
+}
+
+// Parses and verifies all of |images| on |jobs| threads, each image on
+// one, as qcert --recursive -V does.
+static void Sweep(vector<unique_ptr<BenchImage>> &images, unsigned jobs) {
+  atomic<size_t> next(0);
+  auto worker = [&] {
+    for (size_t i = next++; i < images.size(); i = next++) {
+      image_info info;
+      parse_image(images[i]->view, &info);
+      verify_image(images[i]->view, &info, 1);
+    }
+  };
+  vector<thread> threads;
+  for (unsigned i = 1; i < jobs; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned jobs = thread::hardware_concurrency();
+  double min_time = 0.2;
+  struct option options[] = {
+      {"jobs", required_argument, NULL, 'j'},
+      {"time", required_argument, NULL, 't'},
+      {NULL, 0, NULL, 0},
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "j:t:", options, NULL)) != -1) {
+    switch (c) {
+      case 'j': {
+        char *end;
+        long n = strtol(optarg, &end, 10);
+        if (end == optarg || *end || n <= 0 || n > INT_MAX) {
+          fprintf(stderr, "bad number of jobs: %s\n%s", optarg, bench_usage);
+          return -1;
+        }
+        jobs = n;
+        break;
+      }
+      case 't':
+        min_time = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "%s", bench_usage);
+        return -1;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, "%s", bench_usage);
+    return -1;
+  }
+  if (jobs == 0) {
+    jobs = 1;
+  }
+
+  vector<unique_ptr<BenchImage>> images;
+  uint64_t total = 0;
+  bool ok = true;
+  for (int i = optind; i < argc; ++i) {
+    unique_ptr<BenchImage> img(new BenchImage);
+    const char *slash = strrchr(argv[i], '/');
+    img->name = slash ? slash + 1 : argv[i];
+    if (open_input(argv[i], &img->view) == -1) {
+      return -1;
+    }
+    img->info.path = argv[i];
+    if (parse_image(img->view, &img->info) == -1 ||
+        verify_image(img->view, &img->info, 1) == -1 ||
+        !image_ok(img->info)) {
+      fprintf(stderr, "%s: %s\n", argv[i],
+              img->info.error.empty() ? "verification failed"
+                                      : img->info.error.c_str());
+      ok = false;
+      continue;
+    }
+    total += img->view.size();
+    images.push_back(move(img));
+  }
+  if (images.empty()) {
+    return -1;
+  }
+
+  printf("%zu images, %.1f MiB, %u threads\n", images.size(),
+         total / (1024.0 * 1024), jobs);
+  printf("%-28s %-13s %8s %12s %10s\n", "image", "step", "runs", "us/run",
+         "MB/s");
+  for (auto &img : images) {
+    BenchSteps(img.get(), min_time);
+  }
+
+  // Sweeps with the caches emptied first, as for a fresh process, and
+  // full, as for the rest of a tree signed by the same few chains.
+  string name = "batch of " + to_string(images.size());
+  vector<unsigned> counts(1, 1);
+  if (jobs > 1) {
+    counts.push_back(jobs);
+  }
+  for (unsigned n : counts) {
+    for (bool cached : {false, true}) {
+      unsigned runs;
+      double secs = Time(min_time, [&] {
+        if (!cached) {
+          ClearCaches();
+        }
+        Sweep(images, n);
+      }, &runs);
+      string step = (cached ? "cached-j" : "sweep-j") + to_string(n);
+      Report(name, step.c_str(), runs, secs, total);
+    }
+  }
+  return ok ? 0 : 1;
+}
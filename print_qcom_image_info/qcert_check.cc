@@ -0,0 +1,60 @@
+// Checks parts of qcert against known answers, independent of the images
+// gen_qcom_elf makes. Built from qcert.cc itself, as qcert_bench is.
+
+#define QCERT_NO_MAIN
+#include "qcert.cc"
+
+namespace {
+
+// The digest an RSA attestation key signs, worked out from the sectools
+// formula H((HW_ID ^ opad) || H((SW_ID ^ ipad) || H(data))).
+struct KeyedDigestVector {
+  const char *data;
+  const char *sw_id_ou;
+  const char *hw_id_ou;
+  const EVP_MD *(*md)();
+  const char *digest;
+};
+
+const KeyedDigestVector kKeyedDigestVectors[] = {
+    {"abc", "OU=01 0000000000000019 SW_ID", "OU=02 009600E100000000 HW_ID",
+     EVP_sha256,
+     "61A815D6B3CCD7BB6B20FFB38E28E81BA9B7928A27CBCCB7D59BB3DDD17E9DE8"},
+    {"abc", "OU=01 0000000000000019 SW_ID", "OU=02 009600E100000000 HW_ID",
+     EVP_sha384,
+     "BE7142BBCF753F37CD4ACB91811039419DFAB23BEC5D63632AC8A123D01694D3"
+     "672B6C853123584429D3105248A5018F"},
+    {"", "OU=01 000000000000002C SW_ID", "OU=02 000000E100000000 HW_ID",
+     EVP_sha256,
+     "48CEBD2AE06F833340C2DDDFA17DAAB14F079EE60868127D6C0CF0A77B3F6DFF"},
+};
+
+}  // namespace
+
+static bool check_keyed_digests() {
+  bool ok = true;
+  for (const auto &v : kKeyedDigestVectors) {
+    cert_info att;
+    att.ous.push_back(v.sw_id_ou);
+    att.ous.push_back(v.hw_id_ou);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned len;
+    string got;
+    if (rsa_signed_digest(reinterpret_cast<const uint8_t *>(v.data),
+                          strlen(v.data), att, v.md(), digest, &len)) {
+      got = hex_encode(reinterpret_cast<const char *>(digest), len);
+    }
+    if (got != v.digest) {
+      fprintf(stderr, "rsa_signed_digest(\"%s\", %s): %s, want %s\n", v.data,
+              md_name(v.md()), got.c_str(), v.digest);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+int main() {
+  bool ok = check_keyed_digests();
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}